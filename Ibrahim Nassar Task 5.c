@@ -1,79 +1,545 @@
+#define _GNU_SOURCE // statx
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <limits.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-// Recursively scans a directory and updates a histogram based on file sizes
-void traverse_dir(const char *dir_path, int bin_width, unsigned long **hist, int *hist_size) {
-    DIR *dir = opendir(dir_path); // Open the directory
+// Counts of files per size bin, grown as larger files show up
+typedef struct {
+    unsigned long *bins;
+    int size;
+} Histogram;
+
+// Grows the histogram to new_size bins, zeroing the new ones
+void grow_histogram(Histogram *hist, int new_size) {
+    unsigned long *new_hist = realloc(hist->bins, new_size * sizeof(unsigned long));
+    if (new_hist == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+
+    // Initialize new bins to zero
+    for (int i = hist->size; i < new_size; i++) {
+        new_hist[i] = 0;
+    }
+
+    hist->bins = new_hist;
+    hist->size = new_size;
+}
+
+// Adds one file of the given size to its bin
+void add_file(Histogram *hist, off_t file_size, int bin_width) {
+    int bin_index = file_size / bin_width; // Determine which bin this file belongs to
+
+    // Resize histogram array if this bin doesn't exist yet
+    if (bin_index >= hist->size)
+        grow_histogram(hist, bin_index + 1);
+
+    hist->bins[bin_index]++; // Increment the count for the appropriate bin
+}
+
+// realloc that gives up on failure, as every caller here would
+void *resize(void *ptr, size_t size) {
+    void *new_ptr = realloc(ptr, size);
+    if (new_ptr == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    return new_ptr;
+}
+
+/*
+ * Parallel walk. Every thread owns a deque of directories still to be
+ * scanned, each an open fd plus its path for error messages. A thread
+ * walks its own subtree depth first and only hands a subdirectory to its
+ * deque while some thread is idle, so paths are built just for the
+ * directories that change hands. It takes work from the back of its own
+ * deque, and an idle thread steals from the front of another's, which is
+ * the oldest and usually largest subtree. Each thread counts into its own
+ * histogram, and the histograms are summed at the end, so the result is
+ * the same as the serial run.
+ */
+typedef struct {
+    int fd;
+    char *path;
+} DirItem;
+
+typedef struct {
+    DirItem *items;
+    int head;               // steal end
+    int tail;               // owner end
+    int capacity;
+    pthread_mutex_t lock;
+} Deque;
+
+typedef struct {
+    Deque *deques;
+    int num_threads;
+    int bin_width;
+    long pending;           // directories queued or being scanned
+    long queued;            // directories sitting in a deque
+    int idle;               // threads waiting for work
+    pthread_mutex_t lock;
+    pthread_cond_t wake;    // work was queued, or everything is done
+} Walker;
+
+typedef struct {
+    Walker *walker;
+    int id;
+    Histogram hist;
+} WalkerThread;
+
+// Queues an open directory; the deque takes over fd and path
+void push_dir(Walker *walker, int id, int fd, char *path) {
+    // Count the directory before a thief can see it, so it cannot finish first
+    pthread_mutex_lock(&walker->lock);
+    walker->pending++;
+    walker->queued++;
+    pthread_mutex_unlock(&walker->lock);
+
+    Deque *deque = &walker->deques[id];
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity) {
+        // Reuse the space stolen from the front before growing
+        if (deque->head > 0) {
+            memmove(deque->items, deque->items + deque->head,
+                    (deque->tail - deque->head) * sizeof(DirItem));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        } else {
+            deque->capacity = deque->capacity ? deque->capacity * 2 : 64;
+            deque->items = resize(deque->items, deque->capacity * sizeof(DirItem));
+        }
+    }
+    deque->items[deque->tail].fd = fd;
+    deque->items[deque->tail++].path = path;
+    pthread_mutex_unlock(&deque->lock);
+
+    pthread_mutex_lock(&walker->lock);
+    pthread_cond_signal(&walker->wake);
+    pthread_mutex_unlock(&walker->lock);
+}
+
+// Takes from the back of the thread's own deque; returns 0 if it is empty
+int pop_dir(Deque *deque, DirItem *item) {
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head) {
+        *item = deque->items[--deque->tail];
+        found = 1;
+    }
+    if (deque->tail == deque->head)
+        deque->head = deque->tail = 0;
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// Takes from the front of another thread's deque
+int steal_dir(Deque *deque, DirItem *item) {
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head) {
+        *item = deque->items[deque->head++];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// More threads are waiting than there are directories queued for them
+int wants_work(Walker *walker) {
+    pthread_mutex_lock(&walker->lock);
+    int hungry = walker->idle > walker->queued;
+    pthread_mutex_unlock(&walker->lock);
+    return hungry;
+}
+
+// Joins root, the relative path below it and a name; only built for messages and hand-offs
+char *join_path(const char *root, const char *rel, size_t rel_len, const char *name) {
+    size_t root_len = strlen(root), name_len = strlen(name);
+    char *path = resize(NULL, root_len + rel_len + name_len + 3);
+    memcpy(path, root, root_len);
+    size_t len = root_len;
+    if (rel_len > 0) {
+        path[len++] = '/';
+        memcpy(path + len, rel, rel_len);
+        len += rel_len;
+    }
+    path[len++] = '/';
+    memcpy(path + len, name, name_len + 1);
+    return path;
+}
+
+// Prints the error for an entry the way perror(path) would
+void report(const char *root, const char *rel, size_t rel_len, const char *name) {
+    char *path = join_path(root, rel, rel_len, name);
+    perror(path);
+    free(path);
+}
+
+/*
+ * Type and size of an entry, relative to its directory and without
+ * following symlinks. Only the type and size are requested, which lets
+ * the filesystem skip filling in the rest.
+ */
+int stat_entry(int dir_fd, const char *name, unsigned char *type, off_t *size) {
+    mode_t mode;
+#ifdef STATX_TYPE
+    struct statx stx;
+    if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_SIZE, &stx) < 0)
+        return -1;
+    mode = stx.stx_mode;
+    *size = stx.stx_size;
+#else
+    struct stat statbuf;
+    if (fstatat(dir_fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) < 0)
+        return -1;
+    mode = statbuf.st_mode;
+    *size = statbuf.st_size;
+#endif
+    *type = S_ISDIR(mode) ? DT_DIR : S_ISREG(mode) ? DT_REG : DT_UNKNOWN;
+    return 0;
+}
+
+/*
+ * One directory on the walk's stack. While it is open it is read with
+ * readdir. When the stack holds more open directories than the fd budget
+ * allows, the shallowest open one has its remaining entries read into
+ * spill (a d_type byte, then the name and its NUL) and its fd closed. On
+ * the way back up it is reopened as ".." of its child, checked against
+ * the device and inode it had, and the spilled entries are walked.
+ */
+typedef struct {
+    DIR *dir;               // NULL once spilled
+    int fd;                 // -1 while closed
+    char *spill;
+    size_t spill_len;
+    size_t spill_pos;
+    dev_t dev;
+    ino_t ino;
+    size_t rel_end;         // length of rel for this directory
+} Level;
+
+int max_open_dirs = 256;    // per walking thread; main sets it from RLIMIT_NOFILE
+
+// Next entry of a level, from the directory or its spilled entries; 0 when done
+int next_entry(Level *level, const char **name, unsigned char *type) {
+    if (level->dir != NULL) {
+        struct dirent *entry = readdir(level->dir);
+        if (entry == NULL)
+            return 0;
+        *name = entry->d_name;
+        *type = entry->d_type;
+        return 1;
+    }
+    if (level->spill_pos >= level->spill_len)
+        return 0;
+    *type = (unsigned char)level->spill[level->spill_pos];
+    *name = level->spill + level->spill_pos + 1;
+    level->spill_pos += strlen(*name) + 2;
+    return 1;
+}
+
+// Reads the rest of an open level into memory and closes its fd
+void spill_level(Level *level) {
+    if (level->dir == NULL) {
+        // Reopened earlier; its entries are in memory already
+        close(level->fd);
+        level->fd = -1;
+        return;
+    }
+    struct stat statbuf;
+    if (fstat(level->fd, &statbuf) == 0) {
+        level->dev = statbuf.st_dev;
+        level->ino = statbuf.st_ino;
+    }
+    size_t capacity = 256;
+    level->spill = resize(NULL, capacity);
+    level->spill_len = level->spill_pos = 0;
+    struct dirent *entry;
+    while ((entry = readdir(level->dir)) != NULL) {
+        size_t name_len = strlen(entry->d_name);
+        if (level->spill_len + name_len + 2 > capacity) {
+            capacity = (level->spill_len + name_len + 2) * 2;
+            level->spill = resize(level->spill, capacity);
+        }
+        level->spill[level->spill_len] = (char)entry->d_type;
+        memcpy(level->spill + level->spill_len + 1, entry->d_name, name_len + 1);
+        level->spill_len += name_len + 2;
+    }
+    closedir(level->dir);
+    level->dir = NULL;
+    level->fd = -1;
+}
+
+/*
+ * Scans the directory open on fd and everything below it, updating the
+ * histogram by file size. Subdirectories are opened relative to their
+ * parent with openat, and an explicit stack of directories replaces the
+ * recursion, so no path is ever resolved again and depth does not use up
+ * the C stack or, through spilling, the fd limit. d_type answers for
+ * directories and for anything that is not a regular file, so only
+ * regular files (and filesystems that do not fill in d_type) cost a
+ * statx. rel holds the path below root_path of the directory on top of
+ * the stack, for error messages.
+ */
+void traverse_dir(int fd, const char *root_path, int bin_width, Histogram *hist,
+                  Walker *walker, int id) {
+    DIR *dir = fdopendir(fd);
     if (dir == NULL) {
-        perror(dir_path); // Print error if it can't be opened
+        perror(root_path); // Print error if it can't be opened
+        close(fd);
         return;
     }
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
+    int depth = 0, capacity = 16;
+    int first_open = 0;     // levels below this one are spilled and closed
+    Level *stack = resize(NULL, capacity * sizeof(Level));
+    char *rel = resize(NULL, 256);
+    size_t rel_len = 0, rel_capacity = 256;
+    memset(&stack[0], 0, sizeof(Level));
+    stack[0].dir = dir;
+    stack[0].fd = fd;
+    depth = 1;
+
+    while (depth > 0) {
+        Level *top = &stack[depth - 1];
+        const char *name;
+        unsigned char type;
+        if (!next_entry(top, &name, &type)) {
+            // Done reading the directory, back to its parent
+            if (depth > 1 && first_open == depth - 1) {
+                Level *parent = &stack[depth - 2];
+                struct stat statbuf;
+                // A top cut off from its ancestors below has no fd to climb from
+                if (top->fd >= 0)
+                    parent->fd = openat(top->fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (top->fd >= 0 &&
+                    (parent->fd < 0 || fstat(parent->fd, &statbuf) < 0 ||
+                     statbuf.st_dev != parent->dev || statbuf.st_ino != parent->ino)) {
+                    fprintf(stderr, "%s%s%.*s: directory moved during the walk\n", root_path,
+                            parent->rel_end > 0 ? "/" : "", (int)parent->rel_end, rel);
+                    if (parent->fd >= 0)
+                        close(parent->fd);
+                    // The rest of the spilled ancestors cannot be reached again
+                    for (int k = 0; k < depth - 1; k++) {
+                        stack[k].fd = -1;
+                        stack[k].spill_pos = stack[k].spill_len;
+                    }
+                }
+                first_open = depth - 2;
+            }
+            if (top->dir != NULL)
+                closedir(top->dir);
+            else if (top->fd >= 0)
+                close(top->fd);
+            free(top->spill);
+            depth--;
+            rel_len = depth > 0 ? stack[depth - 1].rel_end : 0;
+            continue;
+        }
+
         // Skip the current (.) and parent (..) directories
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
             continue;
 
-        // Construct full file/directory path
-        char path[PATH_MAX];
-        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+        off_t file_size = 0;
+        if (type == DT_REG || type == DT_UNKNOWN) {
+            if (stat_entry(top->fd, name, &type, &file_size) < 0) {
+                report(root_path, rel, rel_len, name); // Skip if error getting info
+                continue;
+            }
+        }
 
-        struct stat statbuf;
-        if (lstat(path, &statbuf) < 0) {
-            perror(path); // Skip if error getting info
+        // If it's a regular file, process its size
+        if (type == DT_REG) {
+            add_file(hist, file_size, bin_width);
             continue;
         }
+        if (type != DT_DIR)
+            continue;
+
+        // Keep within the fd budget; top itself is never the one spilled
+        if (depth - first_open >= max_open_dirs && first_open < depth - 1)
+            spill_level(&stack[first_open++]);
 
-        // If it's a subdirectory, go deeper recursively
-        if (S_ISDIR(statbuf.st_mode)) {
-            traverse_dir(path, bin_width, hist, hist_size);
+        // A subdirectory: open it relative to this one and go deeper
+        int sub_fd = openat(top->fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (sub_fd < 0) {
+            report(root_path, rel, rel_len, name);
+            continue;
+        }
+        if (walker != NULL && wants_work(walker)) {
+            push_dir(walker, id, sub_fd, join_path(root_path, rel, rel_len, name));
+            continue;
+        }
+        DIR *sub = fdopendir(sub_fd);
+        if (sub == NULL) {
+            report(root_path, rel, rel_len, name);
+            close(sub_fd);
+            continue;
         }
-        // If it's a regular file, process its size
-        else if (S_ISREG(statbuf.st_mode)) {
-            off_t file_size = statbuf.st_size;
-            int bin_index = file_size / bin_width; // Determine which bin this file belongs to
-
-            // Resize histogram array if this bin doesn't exist yet
-            if (bin_index >= *hist_size) {
-                int new_size = bin_index + 1;
-                unsigned long *new_hist = realloc(*hist, new_size * sizeof(unsigned long));
-                if (new_hist == NULL) {
-                    perror("realloc");
-                    exit(EXIT_FAILURE);
-                }
 
-                // Initialize new bins to zero
-                for (int i = *hist_size; i < new_size; i++) {
-                    new_hist[i] = 0;
-                }
+        size_t name_len = strlen(name);
+        if (rel_len + name_len + 2 > rel_capacity) {
+            rel_capacity = (rel_len + name_len + 2) * 2;
+            rel = resize(rel, rel_capacity);
+        }
+        if (rel_len > 0)
+            rel[rel_len++] = '/';
+        memcpy(rel + rel_len, name, name_len);
+        rel_len += name_len;
 
-                *hist = new_hist;
-                *hist_size = new_size;
-            }
+        if (depth == capacity) {
+            capacity *= 2;
+            stack = resize(stack, capacity * sizeof(Level));
+        }
+        memset(&stack[depth], 0, sizeof(Level));
+        stack[depth].dir = sub;
+        stack[depth].fd = sub_fd;
+        stack[depth++].rel_end = rel_len;
+    }
+
+    free(stack);
+    free(rel);
+}
+
+// Opens the starting directory, reporting it the way opendir's caller did
+int open_start(const char *start_dir) {
+    int fd = open(start_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        perror(start_dir);
+    return fd;
+}
 
-            (*hist)[bin_index]++; // Increment the count for the appropriate bin
+void *walk_worker(void *arg) {
+    WalkerThread *self = (WalkerThread *)arg;
+    Walker *walker = self->walker;
+
+    while (1) {
+        // Own work first, then the other deques starting from the next thread
+        DirItem item;
+        int found = pop_dir(&walker->deques[self->id], &item);
+        for (int k = 1; !found && k < walker->num_threads; k++)
+            found = steal_dir(&walker->deques[(self->id + k) % walker->num_threads], &item);
+
+        if (!found) {
+            // Nothing to take: sleep until something is queued or the walk is over
+            pthread_mutex_lock(&walker->lock);
+            walker->idle++;
+            while (walker->pending > 0 && walker->queued == 0)
+                pthread_cond_wait(&walker->wake, &walker->lock);
+            walker->idle--;
+            int done = walker->pending == 0;
+            pthread_mutex_unlock(&walker->lock);
+            if (done)
+                break;
+            continue;
         }
+
+        pthread_mutex_lock(&walker->lock);
+        walker->queued--;
+        pthread_mutex_unlock(&walker->lock);
+
+        traverse_dir(item.fd, item.path, walker->bin_width, &self->hist, walker, self->id);
+        free(item.path);
+
+        // The last directory finished wakes everyone up to exit
+        pthread_mutex_lock(&walker->lock);
+        if (--walker->pending == 0)
+            pthread_cond_broadcast(&walker->wake);
+        pthread_mutex_unlock(&walker->lock);
+    }
+    return NULL;
+}
+
+// Walks the tree on num_threads threads and sums their histograms into hist
+void parallel_walk(const char *start_dir, int bin_width, int num_threads, Histogram *hist) {
+    int fd = open_start(start_dir);
+    if (fd < 0)
+        return;
+
+    Walker walker;
+    walker.deques = calloc(num_threads, sizeof(Deque));
+    WalkerThread *workers = calloc(num_threads, sizeof(WalkerThread));
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    if (walker.deques == NULL || workers == NULL || threads == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    walker.num_threads = num_threads;
+    walker.bin_width = bin_width;
+    walker.pending = 0;
+    walker.queued = 0;
+    walker.idle = 0;
+    pthread_mutex_init(&walker.lock, NULL);
+    pthread_cond_init(&walker.wake, NULL);
+    for (int i = 0; i < num_threads; i++)
+        pthread_mutex_init(&walker.deques[i].lock, NULL);
+
+    char *root = strdup(start_dir);
+    if (root == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    push_dir(&walker, 0, fd, root);
+    for (int i = 0; i < num_threads; i++) {
+        workers[i].walker = &walker;
+        workers[i].id = i;
+        pthread_create(&threads[i], NULL, walk_worker, &workers[i]);
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+
+        // Sum this thread's counts into the result
+        Histogram *part = &workers[i].hist;
+        if (part->size > hist->size)
+            grow_histogram(hist, part->size);
+        for (int b = 0; b < part->size; b++)
+            hist->bins[b] += part->bins[b];
+        free(part->bins);
+    }
+
+    // Other threads may steal from any deque until they exit, so free them only now
+    for (int i = 0; i < num_threads; i++) {
+        free(walker.deques[i].items);
+        pthread_mutex_destroy(&walker.deques[i].lock);
     }
 
-    closedir(dir); // Done reading the directory
+    pthread_mutex_destroy(&walker.lock);
+    pthread_cond_destroy(&walker.wake);
+    free(walker.deques);
+    free(workers);
+    free(threads);
 }
 
 int main(int argc, char *argv[]) {
+    int num_threads = 0; // 0: the serial walk
+    int opt;
+    while ((opt = getopt(argc, argv, "j:")) != -1) {
+        if (opt == 'j' && atoi(optarg) > 0) {
+            num_threads = atoi(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-j threads] <start_directory> <bin_width>\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
     // Expect exactly two arguments: starting directory and bin width
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <start_directory> <bin_width>\n", argv[0]);
+    if (argc - optind != 2) {
+        fprintf(stderr, "Usage: %s [-j threads] <start_directory> <bin_width>\n", argv[0]);
         return EXIT_FAILURE;
     }
 
-    char *start_dir = argv[1];
-    int bin_width = atoi(argv[2]); // Convert input to integer
+    char *start_dir = argv[optind];
+    int bin_width = atoi(argv[optind + 1]); // Convert input to integer
 
     if (bin_width <= 0) {
         fprintf(stderr, "Error: bin_width must be a positive integer.\n");
@@ -81,26 +547,41 @@ int main(int argc, char *argv[]) {
     }
 
     // Allocate space for the histogram (start small, grow dynamically)
-    int hist_size = 16;
-    unsigned long *hist = calloc(hist_size, sizeof(unsigned long));
-    if (hist == NULL) {
+    Histogram hist;
+    hist.size = 16;
+    hist.bins = calloc(hist.size, sizeof(unsigned long));
+    if (hist.bins == NULL) {
         perror("calloc");
         return EXIT_FAILURE;
     }
 
+    // Share the fd limit between the walking threads, leaving some spare
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        long walkers = num_threads > 0 ? num_threads : 1;
+        long budget = ((long)limit.rlim_cur - 16 - walkers) / walkers;
+        max_open_dirs = budget < 4 ? 4 : budget > 4096 ? 4096 : (int)budget;
+    }
+
     // Start traversing the directory
-    traverse_dir(start_dir, bin_width, &hist, &hist_size);
+    if (num_threads > 0) {
+        parallel_walk(start_dir, bin_width, num_threads, &hist);
+    } else {
+        int fd = open_start(start_dir);
+        if (fd >= 0)
+            traverse_dir(fd, start_dir, bin_width, &hist, NULL, 0);
+    }
 
     // Print the histogram (file size ranges and counts)
     printf("Histogram of file sizes (bin width: %d bytes):\n", bin_width);
-    for (int i = 0; i < hist_size; i++) {
-        if (hist[i] > 0) {
+    for (int i = 0; i < hist.size; i++) {
+        if (hist.bins[i] > 0) {
             unsigned long lower = i * bin_width;
             unsigned long upper = (i + 1) * bin_width - 1;
-            printf("%10lu - %10lu : %lu\n", lower, upper, hist[i]);
+            printf("%10lu - %10lu : %lu\n", lower, upper, hist.bins[i]);
         }
     }
 
-    free(hist); // Free allocated memory
+    free(hist.bins); // Free allocated memory
     return EXIT_SUCCESS;
 }
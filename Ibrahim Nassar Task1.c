@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,9 +8,17 @@
 #include <fcntl.h>
 #include <ctype.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/resource.h>
 
 #define MAX_LINE 1024
 #define MAX_ARGS 100
+#define PATH_CACHE_BUCKETS 64
 
 int shell_cd(char **args);
 int shell_dir(char **args);
@@ -19,6 +28,9 @@ int shell_echo(char **args);
 int shell_help(char **args);
 int shell_pause_shell(char **args);
 int shell_quit(char **args);
+int shell_hash(char **args);
+int shell_jobs(char **args);
+int shell_wait(char **args);
 
 char *builtin_str[] = {
     "cd",
@@ -28,7 +40,10 @@ char *builtin_str[] = {
     "echo",
     "help",
     "pause",
-    "quit"
+    "quit",
+    "hash",
+    "jobs",
+    "wait"
 };
 
 int (*builtin_func[]) (char **) = {
@@ -39,23 +54,432 @@ int (*builtin_func[]) (char **) = {
     &shell_echo,
     &shell_help,
     &shell_pause_shell,
-    &shell_quit
+    &shell_quit,
+    &shell_hash,
+    &shell_jobs,
+    &shell_wait
 };
 
 int num_builtins() {
     return sizeof(builtin_str) / sizeof(char *);
 }
 
+/*
+ * stdout is fully buffered, so anything the shell has printed is flushed
+ * before a diagnostic goes to stderr; otherwise the two come out of order
+ * when they share a file or pipe.
+ */
+void print_error(const char *format, ...) {
+    va_list ap;
+    fflush(stdout);
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+}
+
+// perror, after flushing stdout
+void print_errno(const char *what) {
+    int err = errno;
+    fflush(stdout);
+    errno = err;
+    perror(what);
+}
+
+typedef struct PathEntry {
+    char *name;
+    char *path;
+    unsigned long hits;
+    struct PathEntry *next;
+} PathEntry;
+
+// Resolved locations of external commands, keyed by command name
+PathEntry *path_cache[PATH_CACHE_BUCKETS];
+
+unsigned int hash_name(const char *name) {
+    unsigned int h = 5381;
+    while (*name)
+        h = h * 33 + (unsigned char)*name++;
+    return h % PATH_CACHE_BUCKETS;
+}
+
+void clear_path_cache() {
+    for (int i = 0; i < PATH_CACHE_BUCKETS; i++) {
+        PathEntry *e = path_cache[i];
+        while (e != NULL) {
+            PathEntry *next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            e = next;
+        }
+        path_cache[i] = NULL;
+    }
+}
+
+void forget_path(const char *name) {
+    PathEntry **link = &path_cache[hash_name(name)];
+    while (*link != NULL) {
+        PathEntry *e = *link;
+        if (strcmp(e->name, name) == 0) {
+            *link = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            return;
+        }
+        link = &e->next;
+    }
+}
+
+// Walks $PATH the way execvp does and returns a malloc'd path, or NULL
+char *search_path(const char *name, int *cacheable) {
+    const char *path = getenv("PATH");
+    if (path == NULL)
+        path = "/bin:/usr/bin";
+    size_t name_len = strlen(name);
+    const char *dir = path;
+
+    while (1) {
+        const char *end = strchrnul(dir, ':');
+        size_t dir_len = end - dir;
+        char *candidate = malloc(dir_len + name_len + 2);
+        if (!candidate) {
+            print_error("Allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        if (dir_len == 0) {
+            // An empty entry means the current directory
+            memcpy(candidate, name, name_len + 1);
+        } else {
+            memcpy(candidate, dir, dir_len);
+            candidate[dir_len] = '/';
+            memcpy(candidate + dir_len + 1, name, name_len + 1);
+        }
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            // Relative entries depend on the cwd, so they are never cached
+            *cacheable = dir_len > 0 && dir[0] == '/';
+            return candidate;
+        }
+        free(candidate);
+        if (*end == '\0')
+            return NULL;
+        dir = end + 1;
+    }
+}
+
+// Returns the cached location of a command, resolving it on a miss
+const char *lookup_path(const char *name, char **uncached) {
+    unsigned int bucket = hash_name(name);
+    *uncached = NULL;
+    for (PathEntry *e = path_cache[bucket]; e != NULL; e = e->next) {
+        if (strcmp(e->name, name) == 0) {
+            e->hits++;
+            return e->path;
+        }
+    }
+
+    int cacheable = 0;
+    char *path = search_path(name, &cacheable);
+    if (path == NULL)
+        return NULL;
+    if (!cacheable) {
+        *uncached = path;
+        return path;
+    }
+    PathEntry *e = malloc(sizeof(PathEntry));
+    if (!e || !(e->name = strdup(name))) {
+        print_error("Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    e->path = path;
+    e->hits = 1;
+    e->next = path_cache[bucket];
+    path_cache[bucket] = e;
+    return path;
+}
+
+typedef struct {
+    int id;
+    pid_t *pids;
+    int *statuses;                  // wait status per stage, -1 until reaped
+    int num_pids;
+    volatile sig_atomic_t running;  // stages not yet reaped
+    char *command;
+} Job;
+
+// Background jobs; only touched by the main flow with SIGCHLD blocked
+Job *jobs = NULL;
+volatile sig_atomic_t num_jobs = 0;
+int max_jobs = 0;
+int next_job_id = 1;
+int interactive = 0;
+int last_status = 0;
+sigset_t default_sigmask;
+
+void reap_jobs(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    for (int i = 0; i < num_jobs; i++) {
+        Job *job = &jobs[i];
+        for (int k = 0; job->running > 0 && k < job->num_pids; k++) {
+            int status;
+            if (job->statuses[k] != -1 || job->pids[k] <= 0)
+                continue;
+            if (waitpid(job->pids[k], &status, WNOHANG) == job->pids[k]) {
+                job->statuses[k] = status;
+                job->running--;
+            }
+        }
+    }
+    errno = saved_errno;
+}
+
+void block_sigchld(sigset_t *old) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, old);
+}
+
+int status_code(int status) {
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return 1;
+}
+
+int job_status(Job *job) {
+    int status = job->statuses[job->num_pids - 1];
+    return status == -1 ? 1 : status_code(status);
+}
+
+// Called with SIGCHLD blocked, right after the stages were spawned
+Job *add_job(pid_t *pids, int num_pids, char *command) {
+    if (num_jobs == max_jobs) {
+        int new_max = max_jobs ? max_jobs * 2 : 16;
+        Job *new_jobs = realloc(jobs, new_max * sizeof(Job));
+        if (!new_jobs) {
+            print_error("Allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        jobs = new_jobs;
+        max_jobs = new_max;
+    }
+    Job *job = &jobs[num_jobs];
+    job->id = next_job_id++;
+    job->pids = pids;
+    job->statuses = malloc(num_pids * sizeof(int));
+    if (!job->statuses) {
+        print_error("Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    job->num_pids = num_pids;
+    job->running = 0;
+    for (int k = 0; k < num_pids; k++) {
+        job->statuses[k] = pids[k] > 0 ? -1 : 1 << 8;
+        if (pids[k] > 0)
+            job->running++;
+    }
+    job->command = command;
+    num_jobs++;
+    return job;
+}
+
+// Called with SIGCHLD blocked
+void remove_job(int index) {
+    free(jobs[index].pids);
+    free(jobs[index].statuses);
+    free(jobs[index].command);
+    memmove(&jobs[index], &jobs[index + 1], (num_jobs - index - 1) * sizeof(Job));
+    num_jobs--;
+}
+
+void print_job(Job *job) {
+    if (job->running > 0)
+        printf("[%d] Running\t%d\t%s\n", job->id, job->pids[job->num_pids - 1], job->command);
+    else if (job_status(job) == 0)
+        printf("[%d] Done\t%d\t%s\n", job->id, job->pids[job->num_pids - 1], job->command);
+    else
+        printf("[%d] Exit %d\t%d\t%s\n", job->id, job_status(job),
+               job->pids[job->num_pids - 1], job->command);
+}
+
+// Before an interactive prompt, announce and forget jobs that have finished
+void notify_jobs() {
+    sigset_t old;
+    block_sigchld(&old);
+    for (int i = 0; i < num_jobs;) {
+        if (jobs[i].running == 0) {
+            print_job(&jobs[i]);
+            remove_job(i);
+        } else {
+            i++;
+        }
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+typedef struct {
+    double real;
+    double user;
+    double sys;
+    long max_rss;       // KiB
+    long ctx_switches;  // voluntary and involuntary
+} Usage;
+
+typedef struct {
+    char *line;
+    char *name;
+    Usage usage;
+} ProfileEntry;
+
+// Resources used by the children of the last foreground command
+Usage child_usage;
+Usage last_usage;
+int profiling = 0;
+ProfileEntry *profile = NULL;
+int profile_size = 0;
+int profile_max = 0;
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double timeval_seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void add_rusage(Usage *usage, struct rusage *ru) {
+    usage->user += timeval_seconds(ru->ru_utime);
+    usage->sys += timeval_seconds(ru->ru_stime);
+    if (ru->ru_maxrss > usage->max_rss)
+        usage->max_rss = ru->ru_maxrss;
+    usage->ctx_switches += ru->ru_nvcsw + ru->ru_nivcsw;
+}
+
+void print_usage(FILE *out, Usage *usage) {
+    fprintf(out, "real %.3fs  user %.3fs  sys %.3fs  maxrss %ldKB  ctxsw %ld\n",
+            usage->real, usage->user, usage->sys, usage->max_rss, usage->ctx_switches);
+}
+
+// Takes ownership of line
+void profile_add(char *line, const char *name, Usage *usage) {
+    if (profile_size == profile_max) {
+        profile_max = profile_max ? profile_max * 2 : 256;
+        profile = realloc(profile, profile_max * sizeof(ProfileEntry));
+        if (!profile) {
+            print_error("Allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    ProfileEntry *e = &profile[profile_size++];
+    e->line = line;
+    e->name = strdup(name ? name : "");
+    e->usage = *usage;
+}
+
+typedef struct {
+    const char *name;
+    long count;
+    Usage usage;
+} ProfileTotal;
+
+int compare_name(const void *a, const void *b) {
+    return strcmp(((ProfileEntry *)a)->name, ((ProfileEntry *)b)->name);
+}
+
+int compare_entry_real(const void *a, const void *b) {
+    double x = ((ProfileEntry *)a)->usage.real, y = ((ProfileEntry *)b)->usage.real;
+    return (x < y) - (x > y);
+}
+
+int compare_total_real(const void *a, const void *b) {
+    double x = ((ProfileTotal *)a)->usage.real, y = ((ProfileTotal *)b)->usage.real;
+    return (x < y) - (x > y);
+}
+
+int compare_total_count(const void *a, const void *b) {
+    long x = ((ProfileTotal *)a)->count, y = ((ProfileTotal *)b)->count;
+    return (x < y) - (x > y);
+}
+
+/*
+ * Written to stderr at exit when --profile is given: every command name
+ * with its run count and summed usage, most expensive first, followed by
+ * the slowest single lines and the most frequently run commands.
+ */
+void profile_report() {
+    int top = 10;
+    fflush(stdout);
+    if (profile_size == 0)
+        return;
+
+    ProfileEntry *sorted = malloc(profile_size * sizeof(ProfileEntry));
+    ProfileTotal *totals = malloc(profile_size * sizeof(ProfileTotal));
+    if (!sorted || !totals) {
+        fprintf(stderr, "Allocation error\n");
+        return;
+    }
+
+    // Group the lines by command name into per-command totals
+    memcpy(sorted, profile, profile_size * sizeof(ProfileEntry));
+    qsort(sorted, profile_size, sizeof(ProfileEntry), compare_name);
+    int num_totals = 0;
+    for (int i = 0; i < profile_size; i++) {
+        Usage *u = &sorted[i].usage;
+        if (num_totals == 0 || strcmp(totals[num_totals - 1].name, sorted[i].name) != 0) {
+            memset(&totals[num_totals], 0, sizeof(ProfileTotal));
+            totals[num_totals++].name = sorted[i].name;
+        }
+        ProfileTotal *t = &totals[num_totals - 1];
+        t->count++;
+        t->usage.real += u->real;
+        t->usage.user += u->user;
+        t->usage.sys += u->sys;
+        t->usage.ctx_switches += u->ctx_switches;
+        if (u->max_rss > t->usage.max_rss)
+            t->usage.max_rss = u->max_rss;
+    }
+
+    qsort(totals, num_totals, sizeof(ProfileTotal), compare_total_real);
+    fprintf(stderr, "== profile: %d lines, %d commands ==\n", profile_size, num_totals);
+    fprintf(stderr, "%-16s %8s %10s %10s %10s %10s %8s\n",
+            "command", "count", "real", "user", "sys", "maxrss_kb", "ctxsw");
+    for (int i = 0; i < num_totals; i++) {
+        Usage *u = &totals[i].usage;
+        fprintf(stderr, "%-16s %8ld %10.3f %10.3f %10.3f %10ld %8ld\n", totals[i].name,
+                totals[i].count, u->real, u->user, u->sys, u->max_rss, u->ctx_switches);
+    }
+
+    memcpy(sorted, profile, profile_size * sizeof(ProfileEntry));
+    qsort(sorted, profile_size, sizeof(ProfileEntry), compare_entry_real);
+    fprintf(stderr, "== slowest lines ==\n");
+    for (int i = 0; i < profile_size && i < top; i++)
+        fprintf(stderr, "%10.3f  %s\n", sorted[i].usage.real, sorted[i].line);
+
+    qsort(totals, num_totals, sizeof(ProfileTotal), compare_total_count);
+    fprintf(stderr, "== most frequent commands ==\n");
+    for (int i = 0; i < num_totals && i < top; i++)
+        fprintf(stderr, "%8ld  %s\n", totals[i].count, totals[i].name);
+
+    free(sorted);
+    free(totals);
+}
+
 int shell_cd(char **args) {
     if (args[1] == NULL) {
         char *cwd = getenv("PWD");
         if (cwd)
             printf("%s\n", cwd);
         else
-            fprintf(stderr, "PWD not set.\n");
+            print_error("PWD not set.\n");
     } else {
         if (chdir(args[1]) != 0) {
-            perror("cd");
+            print_errno("cd");
         } else {
             char cwd[1024];
             if (getcwd(cwd, sizeof(cwd)) != NULL) {
@@ -63,7 +487,6 @@ int shell_cd(char **args) {
             }
         }
     }
-    fflush(stdout);
     return 1;
 }
 
@@ -74,16 +497,16 @@ int shell_dir(char **args) {
     }
     DIR *d = opendir(dir);
     if (d == NULL) {
-        perror("dir");
+        print_errno("dir");
         return 1;
     }
     struct dirent *entry;
     while ((entry = readdir(d)) != NULL) {
-        printf("%s\t", entry->d_name);
+        fputs(entry->d_name, stdout);
+        putchar('\t');
     }
-    printf("\n");
+    putchar('\n');
     closedir(d);
-    fflush(stdout);
     return 1;
 }
 
@@ -92,18 +515,19 @@ int shell_environ(char **args) {
     for (char **env = environ; *env != 0; env++) {
         printf("%s\n", *env);
     }
-    fflush(stdout);
     return 1;
 }
 
 int shell_set(char **args) {
     if (args[1] == NULL || args[2] == NULL) {
-        fprintf(stderr, "Usage: set VARIABLE VALUE\n");
+        print_error("Usage: set VARIABLE VALUE\n");
         fflush(stderr);
         return 1;
     }
     if (setenv(args[1], args[2], 1) != 0) {
-        perror("set");
+        print_errno("set");
+    } else if (strcmp(args[1], "PATH") == 0) {
+        clear_path_cache();
     }
     return 1;
 }
@@ -111,14 +535,12 @@ int shell_set(char **args) {
 int shell_echo(char **args) {
     if (args[1] == NULL) {
         printf("\n");
-        fflush(stdout);
         return 1;
     }
     for (int i = 1; i < MAX_ARGS && args[i] != NULL; i++) {
         printf("%s ", args[i]);
     }
     printf("\n");
-    fflush(stdout);
     return 1;
 }
 
@@ -133,8 +555,11 @@ int shell_help(char **args) {
     printf("  help                Display this help message\n");
     printf("  pause               Pause the shell until 'Enter' is pressed\n");
     printf("  quit                Exit the shell\n");
-    printf("External commands are also supported.\n");
-    fflush(stdout);
+    printf("  hash [-r] [NAME...] List, clear (-r) or add remembered command locations\n");
+    printf("  jobs                List background jobs\n");
+    printf("  wait [-n | ID...]   Wait for all, the next, or the given background jobs\n");
+    printf("  time COMMAND        Run COMMAND and report its time, memory and switches\n");
+    printf("External commands are also supported, and may be joined with '|'.\n");
     return 1;
 }
 
@@ -149,173 +574,507 @@ int shell_quit(char **args) {
     exit(0);
 }
 
-int launch(char **args, int background, char *input_file, char *output_file, int append) {
-    pid_t pid, wpid;
-    int status;
-    pid = fork();
-    if (pid == 0) {
-        if (input_file != NULL) {
-            int fd0 = open(input_file, O_RDONLY);
-            if (fd0 < 0) {
-                perror("Input redirection");
-                exit(EXIT_FAILURE);
+int shell_jobs(char **args) {
+    (void)args;
+    sigset_t old;
+    block_sigchld(&old);
+    for (int i = 0; i < num_jobs;) {
+        print_job(&jobs[i]);
+        if (jobs[i].running == 0)
+            remove_job(i);
+        else
+            i++;
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return 1;
+}
+
+int find_job(const char *spec) {
+    char *end;
+    long n = strtol(spec[0] == '%' ? spec + 1 : spec, &end, 10);
+    if (*end != '\0' || n <= 0)
+        return -1;
+    for (int i = 0; i < num_jobs; i++) {
+        if (spec[0] == '%') {
+            if (jobs[i].id == n)
+                return i;
+        } else {
+            for (int k = 0; k < jobs[i].num_pids; k++) {
+                if (jobs[i].pids[k] == n)
+                    return i;
             }
-            if (dup2(fd0, STDIN_FILENO) < 0) {
-                perror("dup2");
-                close(fd0);
-                exit(EXIT_FAILURE);
+        }
+    }
+    return -1;
+}
+
+int shell_wait(char **args) {
+    sigset_t old;
+    block_sigchld(&old);
+
+    if (args[1] == NULL) {
+        // Join every background job
+        for (int i = 0; i < num_jobs; i++) {
+            while (jobs[i].running > 0)
+                sigsuspend(&old);
+        }
+        last_status = num_jobs > 0 ? job_status(&jobs[num_jobs - 1]) : 0;
+        while (num_jobs > 0)
+            remove_job(num_jobs - 1);
+    } else if (strcmp(args[1], "-n") == 0) {
+        // Join whichever job finishes first
+        last_status = 127;
+        while (num_jobs > 0) {
+            int i;
+            for (i = 0; i < num_jobs && jobs[i].running > 0; i++)
+                ;
+            if (i < num_jobs) {
+                last_status = job_status(&jobs[i]);
+                remove_job(i);
+                break;
             }
-            close(fd0);
+            sigsuspend(&old);
         }
-        if (output_file != NULL) {
-            int fd1;
-            if (append)
-                fd1 = open(output_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
-            else
-                fd1 = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (fd1 < 0) {
-                perror("Output redirection");
-                exit(EXIT_FAILURE);
+    } else {
+        for (int a = 1; args[a] != NULL; a++) {
+            int i = find_job(args[a]);
+            if (i < 0) {
+                print_error("wait: %s: no such job\n", args[a]);
+                last_status = 127;
+                continue;
+            }
+            while (jobs[i].running > 0)
+                sigsuspend(&old);
+            last_status = job_status(&jobs[i]);
+            remove_job(i);
+        }
+    }
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return 1;
+}
+
+int shell_hash(char **args) {
+    if (args[1] == NULL) {
+        int empty = 1;
+        for (int i = 0; i < PATH_CACHE_BUCKETS; i++) {
+            for (PathEntry *e = path_cache[i]; e != NULL; e = e->next) {
+                if (empty)
+                    printf("hits\tcommand\n");
+                printf("%4lu\t%s\n", e->hits, e->path);
+                empty = 0;
             }
-            if (dup2(fd1, STDOUT_FILENO) < 0) {
-                perror("dup2");
+        }
+        if (empty)
+            printf("hash: hash table empty\n");
+        return 1;
+    }
+    if (strcmp(args[1], "-r") == 0) {
+        clear_path_cache();
+        return 1;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        char *uncached;
+        if (strchr(args[i], '/') != NULL)
+            continue;
+        forget_path(args[i]);
+        if (lookup_path(args[i], &uncached) == NULL)
+            print_error("hash: %s: not found\n", args[i]);
+        free(uncached);
+    }
+    return 1;
+}
+
+typedef struct {
+    char **args;
+    char *input_file;
+    char *output_file;
+    int append;
+    char *error_file;
+    int error_append;
+    int error_to_output;    // 2>&1
+} Stage;
+
+// A parsed line: argv slices point into the line buffer itself
+typedef struct {
+    char **tokens;
+    int max_tokens;
+    Stage *stages;
+    int num_stages;
+    int max_stages;
+    int background;
+} Command;
+
+int find_builtin(const char *name) {
+    for (int i = 0; i < num_builtins(); i++) {
+        if (strcmp(name, builtin_str[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int open_output(const char *output_file, int append) {
+    if (append)
+        return open(output_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    return open(output_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+pid_t spawn_stage(Stage *stage, int in_fd, int out_fd, int unused_fd) {
+    extern char **environ;
+    int fd0 = in_fd, fd1 = out_fd, fd2 = -1;
+    pid_t pid = -1;
+
+    if (stage->input_file != NULL) {
+        fd0 = open(stage->input_file, O_RDONLY | O_CLOEXEC);
+        if (fd0 < 0) {
+            print_errno("Input redirection");
+            return -1;
+        }
+    }
+    if (stage->output_file != NULL) {
+        fd1 = open_output(stage->output_file, stage->append);
+        if (fd1 < 0) {
+            print_errno("Output redirection");
+            if (fd0 != in_fd)
+                close(fd0);
+            return -1;
+        }
+    }
+    if (stage->error_file != NULL) {
+        fd2 = open_output(stage->error_file, stage->error_append);
+        if (fd2 < 0) {
+            print_errno("Error redirection");
+            if (fd0 != in_fd)
+                close(fd0);
+            if (fd1 != out_fd)
                 close(fd1);
-                exit(EXIT_FAILURE);
+            return -1;
+        }
+    }
+
+    int builtin = find_builtin(stage->args[0]);
+    if (builtin >= 0) {
+        /* Builtins inside a pipeline need a copy of the shell to run in. */
+        fflush(stdout);
+        pid = fork();
+        if (pid == 0) {
+            sigprocmask(SIG_SETMASK, &default_sigmask, NULL);
+            if (fd0 >= 0 && fd0 != STDIN_FILENO)
+                dup2(fd0, STDIN_FILENO);
+            if (fd1 >= 0 && fd1 != STDOUT_FILENO)
+                dup2(fd1, STDOUT_FILENO);
+            if (stage->error_to_output)
+                dup2(STDOUT_FILENO, STDERR_FILENO);
+            else if (fd2 >= 0)
+                dup2(fd2, STDERR_FILENO);
+            if (unused_fd >= 0)
+                close(unused_fd);
+            (*builtin_func[builtin])(stage->args);
+            fflush(stdout);
+            _exit(EXIT_SUCCESS);
+        } else if (pid < 0) {
+            print_errno("fork");
+        }
+    } else {
+        /*
+         * posix_spawn creates the child with vfork semantics, so the
+         * shell's address space is never copied. Every descriptor the
+         * shell opens here is close-on-exec; the dup2 actions below are
+         * the only ones the child keeps.
+         */
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attr;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setsigmask(&attr, &default_sigmask);
+#ifdef POSIX_SPAWN_USEVFORK
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_USEVFORK);
+#else
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+#endif
+        if (fd0 >= 0)
+            posix_spawn_file_actions_adddup2(&actions, fd0, STDIN_FILENO);
+        if (fd1 >= 0)
+            posix_spawn_file_actions_adddup2(&actions, fd1, STDOUT_FILENO);
+        if (stage->error_to_output)
+            posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+        else if (fd2 >= 0)
+            posix_spawn_file_actions_adddup2(&actions, fd2, STDERR_FILENO);
+        const char *name = stage->args[0];
+        const char *path = name;
+        char *uncached = NULL;
+        int err;
+        if (strchr(name, '/') == NULL)
+            path = lookup_path(name, &uncached);
+        if (path == NULL) {
+            err = ENOENT;
+        } else {
+            err = posix_spawn(&pid, path, &actions, &attr, stage->args, environ);
+            if (err == ENOENT && uncached == NULL && path != name) {
+                // The remembered binary went away; search $PATH again
+                forget_path(name);
+                path = lookup_path(name, &uncached);
+                err = path ? posix_spawn(&pid, path, &actions, &attr, stage->args, environ)
+                           : ENOENT;
+            }
+        }
+        if (err == ENOEXEC) {
+            // No #! line: run it with /bin/sh, as execvp would
+            int argc = 0;
+            while (stage->args[argc] != NULL)
+                argc++;
+            char **sh_args = malloc((argc + 2) * sizeof(char *));
+            if (sh_args == NULL) {
+                err = ENOMEM;
+            } else {
+                sh_args[0] = "sh";
+                sh_args[1] = (char *)path;
+                memcpy(sh_args + 2, stage->args + 1, argc * sizeof(char *));
+                err = posix_spawn(&pid, "/bin/sh", &actions, &attr, sh_args, environ);
+                free(sh_args);
             }
-            close(fd1);
         }
-        if (execvp(args[0], args) == -1) {
-            perror("exec");
+        free(uncached);
+        if (err != 0) {
+            print_error("exec: %s: %s\n", stage->args[0], strerror(err));
+            pid = -1;
         }
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&actions);
+    }
+
+    if (fd0 != in_fd)
+        close(fd0);
+    if (fd1 != out_fd)
+        close(fd1);
+    if (fd2 >= 0)
+        close(fd2);
+    return pid;
+}
+
+char *describe_command(Stage *stages, int num_stages) {
+    size_t len = 1;
+    for (int i = 0; i < num_stages; i++)
+        for (int k = 0; stages[i].args[k] != NULL; k++)
+            len += strlen(stages[i].args[k]) + 3;
+    char *command = malloc(len);
+    if (!command) {
+        print_error("Allocation error\n");
         exit(EXIT_FAILURE);
-    } else if (pid < 0) {
-        perror("fork");
-    } else {
-        if (!background) {
+    }
+    char *end = command;
+    for (int i = 0; i < num_stages; i++) {
+        if (i > 0)
+            end = stpcpy(end, " | ");
+        for (int k = 0; stages[i].args[k] != NULL; k++) {
+            if (k > 0)
+                *end++ = ' ';
+            end = stpcpy(end, stages[i].args[k]);
+        }
+    }
+    *end = '\0';
+    return command;
+}
+
+int launch(Stage *stages, int num_stages, int background) {
+    pid_t *pids = malloc(num_stages * sizeof(pid_t));
+    int status = 1 << 8;
+    int prev_read = -1;
+    sigset_t old;
+
+    if (!pids) {
+        print_error("Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    fflush(stdout);
+    // Keep the reaper away until a background job is in the table
+    if (background)
+        block_sigchld(&old);
+
+    for (int i = 0; i < num_stages; i++) {
+        int pipefd[2] = {-1, -1};
+        if (i < num_stages - 1 && pipe2(pipefd, O_CLOEXEC) < 0) {
+            print_errno("pipe");
+            pipefd[0] = pipefd[1] = -1;
+        }
+        pids[i] = spawn_stage(&stages[i], prev_read, pipefd[1], pipefd[0]);
+        if (prev_read >= 0)
+            close(prev_read);
+        if (pipefd[1] >= 0)
+            close(pipefd[1]);
+        prev_read = pipefd[0];
+    }
+    if (prev_read >= 0)
+        close(prev_read);
+
+    if (!background) {
+        for (int i = 0; i < num_stages; i++) {
+            struct rusage ru;
+            if (pids[i] <= 0) {
+                status = 127 << 8;
+                continue;
+            }
             do {
-                wpid = waitpid(pid, &status, WUNTRACED);
+                if (wait4(pids[i], &status, WUNTRACED, &ru) < 0)
+                    break;
             } while (!WIFEXITED(status) && !WIFSIGNALED(status));
-        } else {
-            printf("Process running in background with PID %d\n", pid);
-            fflush(stdout);
+            if (WIFEXITED(status) || WIFSIGNALED(status))
+                add_rusage(&child_usage, &ru);
+        }
+        last_status = status_code(status);
+        free(pids);
+    } else {
+        add_job(pids, num_stages, describe_command(stages, num_stages));
+        if (pids[num_stages - 1] > 0) {
+            printf("Process running in background with PID %d\n", pids[num_stages - 1]);
         }
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        last_status = 0;
     }
     return 1;
 }
 
-int execute(char **args) {
-    if (args[0] == NULL) {
-        return 1;
+// Saves fd and points it at target; returns the saved copy or -1 on error
+int redirect_fd(int fd, int target) {
+    int saved = dup(fd);
+    if (saved < 0) {
+        print_errno("dup");
+        return -1;
     }
+    if (dup2(target, fd) < 0) {
+        print_errno("dup2");
+        close(saved);
+        return -1;
+    }
+    return saved;
+}
 
-    int background = 0;
-    char *input_file = NULL;
-    char *output_file = NULL;
-    int append = 0;
-
-    int i = 0;
-    int j;
+void restore_fd(int fd, int saved) {
+    if (saved < 0)
+        return;
+    if (dup2(saved, fd) < 0) {
+        print_errno("dup2");
+    }
+    close(saved);
+}
 
-    while (args[i] != NULL) {
-        if (strcmp(args[i], "<") == 0) {
-            if (args[i + 1] != NULL) {
-                input_file = args[i + 1];
-                for (j = i; args[j + 2] != NULL; j++) {
-                    args[j] = args[j + 2];
-                }
-                args[j] = NULL;
-            } else {
-                fprintf(stderr, "Expected input file after '<'\n");
-                fflush(stderr);
-                return 1;
-            }
-        } else if (strcmp(args[i], ">") == 0) {
-            if (args[i + 1] != NULL) {
-                output_file = args[i + 1];
-                append = 0;
-                for (j = i; args[j + 2] != NULL; j++) {
-                    args[j] = args[j + 2];
-                }
-                args[j] = NULL;
-            } else {
-                fprintf(stderr, "Expected output file after '>'\n");
-                fflush(stderr);
+int run_command(Command *cmd) {
+    Stage *stage = &cmd->stages[0];
+    int j = find_builtin(stage->args[0]);
+    if (cmd->num_stages == 1 && j >= 0) {
+        int saved_stdout = -1, saved_stderr = -1;
+        if (stage->output_file != NULL) {
+            fflush(stdout);
+            int fd = open_output(stage->output_file, stage->append);
+            if (fd < 0) {
+                print_errno("Output redirection");
                 return 1;
             }
-        } else if (strcmp(args[i], ">>") == 0) {
-            if (args[i + 1] != NULL) {
-                output_file = args[i + 1];
-                append = 1;
-                for (j = i; args[j + 2] != NULL; j++) {
-                    args[j] = args[j + 2];
-                }
-                args[j] = NULL;
-            } else {
-                fprintf(stderr, "Expected output file after '>>'\n");
-                fflush(stderr);
+            saved_stdout = redirect_fd(STDOUT_FILENO, fd);
+            close(fd);
+            if (saved_stdout < 0)
                 return 1;
-            }
-        } else if (strcmp(args[i], "&") == 0) {
-            background = 1;
-            args[i] = NULL;
-            break;
-        } else {
-            i++;
         }
-    }
-
-    for (j = 0; j < num_builtins(); j++) {
-        if (strcmp(args[0], builtin_str[j]) == 0) {
-            int saved_stdout = -1;
-            if (output_file != NULL) {
-                saved_stdout = dup(STDOUT_FILENO);
-                if (saved_stdout < 0) {
-                    perror("dup");
-                    return 1;
-                }
-                int fd;
-                if (append)
-                    fd = open(output_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
-                else
-                    fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (stage->error_to_output || stage->error_file != NULL) {
+            int fd = STDOUT_FILENO;
+            if (!stage->error_to_output) {
+                fd = open_output(stage->error_file, stage->error_append);
                 if (fd < 0) {
-                    perror("Output redirection");
-                    close(saved_stdout);
+                    print_errno("Error redirection");
+                    restore_fd(STDOUT_FILENO, saved_stdout);
                     return 1;
                 }
-                if (dup2(fd, STDOUT_FILENO) < 0) {
-                    perror("dup2");
-                    close(fd);
-                    close(saved_stdout);
-                    return 1;
-                }
-                close(fd);
             }
-            int status = (*builtin_func[j])(args);
-            if (output_file != NULL && saved_stdout != -1) {
-                if (dup2(saved_stdout, STDOUT_FILENO) < 0) {
-                    perror("dup2");
-                }
-                close(saved_stdout);
+            saved_stderr = redirect_fd(STDERR_FILENO, fd);
+            if (fd != STDOUT_FILENO)
+                close(fd);
+            if (saved_stderr < 0) {
+                restore_fd(STDOUT_FILENO, saved_stdout);
+                return 1;
             }
-            return status;
         }
+        last_status = 0;
+        int status = (*builtin_func[j])(stage->args);
+        if (saved_stdout >= 0)
+            fflush(stdout);
+        restore_fd(STDOUT_FILENO, saved_stdout);
+        restore_fd(STDERR_FILENO, saved_stderr);
+        return status;
     }
 
-    return launch(args, background, input_file, output_file, append);
+    return launch(cmd->stages, cmd->num_stages, cmd->background);
+}
+
+// The command a line runs, looking past a leading 'time'
+const char *command_name(Command *cmd) {
+    char **args = cmd->stages[0].args;
+    if (strcmp(args[0], "time") == 0 && args[1] != NULL)
+        return args[1];
+    return args[0];
 }
 
-char *read_line(FILE *input_stream) {
-    char *line = NULL;
-    size_t bufsize = 0;
-    if (getline(&line, &bufsize, input_stream) == -1) {
+/*
+ * Runs a parsed line and records what it cost in last_usage: the shell's
+ * own CPU time for the line plus everything its waited-for children used.
+ * A leading 'time' word prints that usage to stderr afterwards.
+ */
+int execute(Command *cmd) {
+    if (cmd->num_stages == 0) {
+        return 1;
+    }
+
+    int timed = strcmp(cmd->stages[0].args[0], "time") == 0;
+    if (timed) {
+        cmd->stages[0].args++;
+        if (cmd->stages[0].args[0] == NULL) {
+            print_error("Expected command after 'time'\n");
+            cmd->stages[0].args--;
+            memset(&last_usage, 0, sizeof(Usage));
+            return 1;
+        }
+    }
+
+    struct rusage before, after;
+    memset(&child_usage, 0, sizeof(Usage));
+    getrusage(RUSAGE_SELF, &before);
+    double start = now_seconds();
+
+    int status = run_command(cmd);
+
+    last_usage = child_usage;
+    last_usage.real = now_seconds() - start;
+    getrusage(RUSAGE_SELF, &after);
+    last_usage.user += timeval_seconds(after.ru_utime) - timeval_seconds(before.ru_utime);
+    last_usage.sys += timeval_seconds(after.ru_stime) - timeval_seconds(before.ru_stime);
+    last_usage.ctx_switches += after.ru_nvcsw + after.ru_nivcsw - before.ru_nvcsw - before.ru_nivcsw;
+    if (last_usage.max_rss == 0)
+        last_usage.max_rss = after.ru_maxrss;
+
+    if (timed) {
+        fflush(stdout);
+        print_usage(stderr, &last_usage);
+    }
+    return status;
+}
+
+// Storage reused by every line: the line buffer, its tokens and stages
+typedef struct {
+    char *line;
+    size_t line_size;
+    Command cmd;
+} LineArena;
+
+char *read_line(FILE *input_stream, LineArena *arena) {
+    char *line;
+    if (getline(&arena->line, &arena->line_size, input_stream) == -1) {
         if (feof(input_stream)) {
             exit(0);
         } else {
-            perror("readline");
+            print_errno("readline");
             exit(EXIT_FAILURE);
         }
     }
+    line = arena->line;
     size_t len = strlen(line);
     if (len > 0 && line[len -1] == '\n') {
         line[len -1] = '\0';
@@ -323,69 +1082,453 @@ char *read_line(FILE *input_stream) {
     return line;
 }
 
-char **split_line(char *line) {
-    int bufsize = MAX_ARGS, position = 0;
-    char **tokens = malloc(bufsize * sizeof(char*));
-    char *token;
+void add_token(Command *cmd, int position, char *token) {
+    if (position >= cmd->max_tokens) {
+        cmd->max_tokens = cmd->max_tokens ? cmd->max_tokens * 2 : MAX_ARGS;
+        cmd->tokens = realloc(cmd->tokens, cmd->max_tokens * sizeof(char *));
+        if (!cmd->tokens) {
+            print_error("Allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    cmd->tokens[position] = token;
+}
 
-    if (!tokens) {
-        fprintf(stderr, "Allocation error\n");
-        exit(EXIT_FAILURE);
+Stage *add_stage(Command *cmd, int first_token) {
+    if (cmd->num_stages >= cmd->max_stages) {
+        cmd->max_stages = cmd->max_stages ? cmd->max_stages * 2 : 4;
+        cmd->stages = realloc(cmd->stages, cmd->max_stages * sizeof(Stage));
+        if (!cmd->stages) {
+            print_error("Allocation error\n");
+            exit(EXIT_FAILURE);
+        }
     }
+    Stage *stage = &cmd->stages[cmd->num_stages++];
+    memset(stage, 0, sizeof(Stage));
+    // Until the token array stops growing, args holds an index into it
+    stage->args = (char **)(long)first_token;
+    return stage;
+}
 
-    token = strtok(line, " \t");
-    while (token != NULL) {
-        tokens[position++] = token;
-        if (position >= bufsize) {
-            bufsize += MAX_ARGS;
-            tokens = realloc(tokens, bufsize * sizeof(char*));
-            if (!tokens) {
-                fprintf(stderr, "Allocation error\n");
-                exit(EXIT_FAILURE);
+int is_operator(char c) {
+    return c == '|' || c == '&' || c == '<' || c == '>';
+}
+
+/*
+ * Splits a line into pipeline stages in a single pass. Words are unquoted
+ * and unescaped in place, so every argument points into the line buffer.
+ * Redirections ('<', '>', '>>', '2>', '2>>', '2>&1') are recorded in the
+ * stage instead of being left in its argument list. Returns -1 after
+ * printing a message if the line is malformed.
+ */
+int parse_line(char *line, Command *cmd) {
+    char *r = line;
+    char **target = NULL;       // redirection waiting for its file name
+    const char *target_name = NULL;
+    Stage *stage = NULL;
+    int position = 0;
+    char op = 0;
+
+    cmd->num_stages = 0;
+    cmd->background = 0;
+
+    while (1) {
+        if (!op) {
+            while (*r == ' ' || *r == '\t')
+                r++;
+            if (*r == '\0')
+                break;
+            if (is_operator(*r)) {
+                op = *r++;
+            } else if (r[0] == '2' && r[1] == '>') {
+                op = '2';
+                r += 2;
+            }
+        }
+
+        if (op) {
+            if (target != NULL) {
+                print_error("Expected %s\n", target_name);
+                return -1;
+            }
+            if (op == '|' || op == '&') {
+                if (stage == NULL) {
+                    print_error("Expected command before '%c'\n", op);
+                    return -1;
+                }
+                add_token(cmd, position++, NULL);
+                stage = NULL;
+                if (op == '&') {
+                    cmd->background = 1;
+                    break;
+                }
+            } else {
+                if (stage == NULL)
+                    stage = add_stage(cmd, position);
+                if (op == '<') {
+                    target = &stage->input_file;
+                    target_name = "input file after '<'";
+                } else if (op == '>') {
+                    stage->append = *r == '>';
+                    target = &stage->output_file;
+                    target_name = stage->append ? "output file after '>>'"
+                                                : "output file after '>'";
+                    r += stage->append;
+                } else if (*r == '&' && r[1] == '1') {
+                    stage->error_to_output = 1;
+                    stage->error_file = NULL;
+                    r += 2;
+                } else {
+                    stage->error_append = *r == '>';
+                    stage->error_to_output = 0;
+                    target = &stage->error_file;
+                    target_name = stage->error_append ? "error file after '2>>'"
+                                                      : "error file after '2>'";
+                    r += stage->error_append;
+                }
             }
+            op = 0;
+            continue;
         }
-        token = strtok(NULL, " \t");
+
+        // A word: copy it down over its own quotes and backslashes
+        char *word = r, *w = r;
+        char c;
+        while ((c = *r) != '\0' && c != ' ' && c != '\t' && !is_operator(c)) {
+            if (c == '\\' && r[1] != '\0') {
+                *w++ = r[1];
+                r += 2;
+            } else if (c == '\'' || c == '"') {
+                r++;
+                while (*r != '\0' && *r != c) {
+                    if (c == '"' && *r == '\\' && r[1] != '\0' && strchr("\"\\$`", r[1]))
+                        r++;
+                    *w++ = *r++;
+                }
+                if (*r == '\0') {
+                    print_error("Unterminated %c quote\n", c);
+                    return -1;
+                }
+                r++;
+            } else {
+                *w++ = *r++;
+            }
+        }
+        // The terminator may be overwritten below, so remember it first
+        if (is_operator(c))
+            op = c;
+        *w = '\0';
+        if (c != '\0')
+            r++;
+
+        if (target != NULL) {
+            *target = word;
+            target = NULL;
+            continue;
+        }
+        if (stage == NULL)
+            stage = add_stage(cmd, position);
+        add_token(cmd, position++, word);
+    }
+
+    if (target != NULL) {
+        print_error("Expected %s\n", target_name);
+        return -1;
     }
-    tokens[position] = NULL;
-    return tokens;
+    if (cmd->num_stages > 0 && stage == NULL && !cmd->background) {
+        print_error("Expected command after '|'\n");
+        return -1;
+    }
+    add_token(cmd, position++, NULL);
+
+    for (int i = 0; i < cmd->num_stages; i++) {
+        cmd->stages[i].args = cmd->tokens + (long)cmd->stages[i].args;
+        if (cmd->stages[i].args[0] == NULL) {
+            print_error("Expected command in stage %d\n", i + 1);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void free_command(Command *cmd) {
+    free(cmd->tokens);
+    free(cmd->stages);
+    memset(cmd, 0, sizeof(Command));
 }
 
 void shell_loop(FILE *input_stream) {
     char cwd[1024];
-    char *line;
-    char **args;
+    LineArena arena = {0};
     int status = 1;
 
     while (1) {
-        if (getcwd(cwd, sizeof(cwd)) != NULL) {
-            printf("%s$ ", cwd);
+        if (interactive) {
+            notify_jobs();
+            if (getcwd(cwd, sizeof(cwd)) != NULL) {
+                printf("%s$ ", cwd);
+            } else {
+                print_errno("getcwd");
+                printf("$ ");
+            }
+            fflush(stdout);
+        }
+        char *line = read_line(input_stream, &arena);
+        char *text = profiling ? strdup(line) : NULL;
+        if (parse_line(line, &arena.cmd) == 0 && arena.cmd.num_stages > 0) {
+            status = execute(&arena.cmd);
+            if (profiling)
+                profile_add(text, command_name(&arena.cmd), &last_usage);
+            else
+                free(text);
         } else {
-            perror("getcwd");
-            printf("$ ");
+            free(text);
         }
+    }
+}
+
+typedef struct {
+    pid_t pid;
+    FILE *output;   // captured stdout and stderr of the line
+    int status;     // wait status, -1 while running
+    char *text;     // copy of the line, kept only when profiling
+    char *name;
+    Usage usage;
+} BatchJob;
+
+// Lines that change the shell itself cannot run in a child, timed or not
+int is_barrier(Command *cmd) {
+    if (cmd->num_stages == 0)
+        return 0;
+    char **args = cmd->stages[0].args;
+    if (strcmp(args[0], "time") == 0 && args[1] != NULL)
+        args++;
+    char *name = args[0];
+    return strcmp(name, "wait") == 0 || strcmp(name, "cd") == 0 || strcmp(name, "set") == 0 ||
+           strcmp(name, "quit") == 0 || strcmp(name, "hash") == 0;
+}
+
+/*
+ * An unlinked temporary file for a job's output. Unlike tmpfile(), its fd
+ * is close-on-exec, so jobs started later do not inherit it.
+ */
+FILE *capture_file() {
+    const char *dir = getenv("TMPDIR");
+    if (dir == NULL || *dir == '\0')
+        dir = "/tmp";
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/shell-XXXXXX", dir);
+    int fd = mkostemp(path, O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    unlink(path);
+    FILE *file = fdopen(fd, "w+");
+    if (file == NULL)
+        close(fd);
+    return file;
+}
+
+// Reaps one batch subshell; returns 1 if it belonged to the window
+int reap_batch_job(BatchJob *window, int head, int count, int capacity, int options) {
+    int status;
+    pid_t pid;
+    struct rusage ru;
+    do {
+        pid = wait4(-1, &status, options, &ru);
+    } while (pid < 0 && errno == EINTR);
+    if (pid < 0) {
+        print_errno("waitpid");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; pid > 0 && i < count; i++) {
+        BatchJob *job = &window[(head + i) % capacity];
+        if (job->pid == pid) {
+            job->status = status;
+            job->usage.real = now_seconds() - job->usage.real;
+            add_rusage(&job->usage, &ru);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Runs the lines of a batch file on up to max_jobs concurrent subshells.
+ * Each line's output is captured and written out in input order. A line
+ * that starts with wait, cd, set, hash or quit is a barrier: everything
+ * before it finishes first, then it runs in the shell itself.
+ * Returns the number of lines that failed.
+ */
+int batch_parallel(FILE *input_stream, int max_jobs) {
+    int capacity = max_jobs * 4;
+    BatchJob *window = malloc(capacity * sizeof(BatchJob));
+    int head = 0, count = 0, running = 0, failures = 0;
+    char buf[8192];
+    LineArena arena = {0};
+    Command *cmd = &arena.cmd;
+
+    if (!window) {
+        print_error("Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while (1) {
+        ssize_t len = getline(&arena.line, &arena.line_size, input_stream);
+        char *line = arena.line;
+        char *text = NULL;
+        int barrier = 1;
+        if (len >= 0) {
+            if (len > 0 && line[len - 1] == '\n')
+                line[len - 1] = '\0';
+            text = profiling ? strdup(line) : NULL;
+            if (parse_line(line, cmd) < 0) {
+                failures++;
+                free(text);
+                continue;
+            }
+            if (cmd->num_stages == 0) {
+                free(text);
+                continue;
+            }
+            barrier = is_barrier(cmd);
+        }
+
+        /*
+         * Write out finished lines from the front of the window. Block
+         * when no slot is free, or drain everything at a barrier.
+         */
+        while (count > 0) {
+            BatchJob *job = &window[head];
+            if (job->status == -1) {
+                int must_wait = barrier || running == max_jobs || count == capacity;
+                if (reap_batch_job(window, head, count, capacity, must_wait ? 0 : WNOHANG))
+                    running--;
+                else if (!must_wait)
+                    break;
+                continue;
+            }
+            rewind(job->output);
+            size_t n;
+            while ((n = fread(buf, 1, sizeof(buf), job->output)) > 0)
+                fwrite(buf, 1, n, stdout);
+            fclose(job->output);
+            if (status_code(job->status) != 0)
+                failures++;
+            if (profiling) {
+                profile_add(job->text, job->name, &job->usage);
+                free(job->name);
+            }
+            head = (head + 1) % capacity;
+            count--;
+        }
+
+        if (len < 0)
+            break;
+        if (barrier) {
+            if (strcmp(cmd->stages[0].args[0], "quit") == 0) {
+                free(text);
+                break;
+            }
+            execute(cmd);
+            if (last_status != 0)
+                failures++;
+            if (profiling)
+                profile_add(text, command_name(cmd), &last_usage);
+            continue;
+        }
+
+        BatchJob *job = &window[(head + count) % capacity];
+        job->output = capture_file();
+        if (job->output == NULL) {
+            print_errno("capture file");
+            exit(EXIT_FAILURE);
+        }
+        job->status = -1;
+        memset(&job->usage, 0, sizeof(Usage));
+        job->usage.real = now_seconds();
+        job->text = text;
+        job->name = profiling ? strdup(command_name(cmd)) : NULL;
         fflush(stdout);
-        line = read_line(input_stream);
-        args = split_line(line);
-        status = execute(args);
-        free(line);
-        free(args);
+        job->pid = fork();
+        if (job->pid == 0) {
+            int fd = fileno(job->output);
+            sigprocmask(SIG_SETMASK, &default_sigmask, NULL);
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            execute(cmd);
+            fflush(stdout);
+            _exit(last_status);
+        } else if (job->pid < 0) {
+            print_errno("fork");
+            fclose(job->output);
+            free(job->text);
+            free(job->name);
+            failures++;
+            continue;
+        }
+        count++;
+        running++;
     }
+
+    fflush(stdout);
+    if (failures > 0)
+        print_error("batch: %d command(s) failed\n", failures);
+    free(arena.line);
+    free(window);
+    free_command(cmd);
+    return failures;
 }
 
 int main(int argc, char **argv) {
     FILE *input_stream = stdin;
+    int max_jobs = 0;
+    int opt;
+    struct option long_options[] = {
+        {"profile", no_argument, NULL, 'p'},
+        {NULL, 0, NULL, 0}
+    };
 
-    if (argc == 2) {
-        input_stream = fopen(argv[1], "r");
+    while ((opt = getopt_long(argc, argv, "j:", long_options, NULL)) != -1) {
+        if (opt == 'j' && atoi(optarg) > 0) {
+            max_jobs = atoi(optarg);
+        } else if (opt == 'p') {
+            profiling = 1;
+        } else {
+            print_error("Usage: %s [-j N] [--profile] [batchfile]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (profiling)
+        atexit(profile_report);
+
+    if (argc - optind == 1) {
+        input_stream = fopen(argv[optind], "r");
         if (input_stream == NULL) {
-            perror("fopen");
+            print_errno("fopen");
             exit(EXIT_FAILURE);
         }
-    } else if (argc > 2) {
-        fprintf(stderr, "Usage: %s [batchfile]\n", argv[0]);
+    } else if (argc - optind > 1) {
+        print_error("Usage: %s [-j N] [--profile] [batchfile]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
+    interactive = isatty(fileno(input_stream));
+
+    /*
+     * One large buffer for everything the shell prints itself. It is
+     * flushed at a prompt, before a child is started, and on exit.
+     */
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
+    // Background jobs are reaped as soon as they exit
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = reap_jobs;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigprocmask(SIG_SETMASK, NULL, &default_sigmask);
+    sigaction(SIGCHLD, &sa, NULL);
+
     if (getenv("PWD") == NULL) {
         char cwd[1024];
         if (getcwd(cwd, sizeof(cwd)) != NULL) {
@@ -393,6 +1536,14 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (max_jobs > 0) {
+        interactive = 0;
+        int failures = batch_parallel(input_stream, max_jobs);
+        if (input_stream != stdin)
+            fclose(input_stream);
+        return failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
     shell_loop(input_stream);
 
     if (input_stream != stdin) {
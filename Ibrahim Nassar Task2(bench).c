@@ -0,0 +1,327 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <spawn.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+/*
+ * Scaling benchmark for the Task2 word counter. Generates a deterministic
+ * Zipf-distributed corpus, runs the counter on it at 1..N threads, checks
+ * every count against the generator's, and prints one CSV row per thread
+ * count. Exits non-zero if any run miscounts, so it can gate changes.
+ *
+ *   bench [options] <counter> [counter options...]
+ *
+ * -g puts a few words of that many KB into the middle of the corpus,
+ * longer than the counter's tiles, to check words that straddle them.
+ */
+
+extern char **environ;
+
+#define WORDS_PER_LINE 12
+
+typedef struct {
+    long sizeMB;
+    long vocab;
+    double exponent;
+    uint64_t seed;
+    int maxThreads;
+    int repeat;
+    const char *keep;       // write the corpus here and leave it
+    long giantKB;           // length of the giant words, 0 for none
+    long giants;            // how many were written
+} Options;
+
+typedef struct {
+    double seconds;
+    long peakRSS;           // kilobytes
+    long lockWaitNs;
+    long steals;
+    int exact;
+} RunResult;
+
+uint64_t nextRandom(uint64_t *state) {
+    // splitmix64: fixed output for a given seed on every platform
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Rank k as a bijective base-26 word: 0 -> a, 25 -> z, 26 -> aa, ...
+int encodeWord(long k, char *out) {
+    char tmp[16];
+    int n = 0;
+    for (k++; k > 0; k = (k - 1) / 26)
+        tmp[n++] = 'a' + (k - 1) % 26;
+    for (int i = 0; i < n; i++)
+        out[i] = tmp[n - 1 - i];
+    return n;
+}
+
+long decodeWord(const char *word, int len) {
+    long k = 0;
+    for (int i = 0; i < len; i++) {
+        if (word[i] < 'a' || word[i] > 'z')
+            return -1;
+        k = k * 26 + (word[i] - 'a' + 1);
+    }
+    return k - 1;
+}
+
+/*
+ * Writes about sizeMB of words drawn with P(rank k) proportional to
+ * 1 / (k + 1)^exponent, and fills counts[] with how often each was used.
+ * Every seventh word starts with a capital to exercise case folding.
+ * Giant words, all the same run of 'q', go in at each quarter of the
+ * corpus; the short words never reach that length.
+ */
+long generateCorpus(int fd, Options *o, long *counts) {
+    double *cdf = malloc(o->vocab * sizeof(double));
+    if (!cdf) {
+        perror("malloc");
+        exit(1);
+    }
+    double sum = 0;
+    for (long k = 0; k < o->vocab; k++) {
+        sum += 1.0 / pow(k + 1, o->exponent);
+        cdf[k] = sum;
+    }
+
+    FILE *out = fdopen(dup(fd), "w");
+    uint64_t state = o->seed;
+    long target = o->sizeMB * 1024 * 1024, written = 0, words = 0;
+    char word[16];
+    while (written < target) {
+        double u = (nextRandom(&state) >> 11) * (1.0 / 9007199254740992.0) * sum;
+        long lo = 0, hi = o->vocab - 1;
+        while (lo < hi) {
+            long mid = (lo + hi) / 2;
+            if (cdf[mid] < u)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        int len = encodeWord(lo, word);
+        if (words % 7 == 0)
+            word[0] -= 32;
+        counts[lo]++;
+        words++;
+        fwrite(word, 1, len, out);
+        fputc(words % WORDS_PER_LINE == 0 ? '\n' : ' ', out);
+        written += len + 1;
+        if (o->giantKB > 0 && written >= (o->giants + 1) * (target / 4) && o->giants < 3) {
+            for (long i = 0; i < o->giantKB * 1024; i++)
+                fputc('q', out);
+            fputc(' ', out);
+            written += o->giantKB * 1024 + 1;
+            o->giants++;
+        }
+    }
+    fclose(out);
+    free(cdf);
+    return written;
+}
+
+double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Checks the counter's "word: count" lines against the generated counts
+int checkCounts(FILE *in, long *counts, const Options *o) {
+    long vocab = o->vocab, giantLen = o->giantKB * 1024;
+    long seen = 0, expectedDistinct = o->giants > 0, expectedTotal = o->giants, total = -1;
+    char *line = NULL;
+    size_t size = 0;
+    int exact = 1;
+    for (long k = 0; k < vocab; k++) {
+        expectedDistinct += counts[k] > 0;
+        expectedTotal += counts[k];
+    }
+    while (getline(&line, &size, in) != -1) {
+        if (sscanf(line, "Total Words: %ld", &total) == 1)
+            continue;
+        char *colon = strrchr(line, ':');
+        if (colon && giantLen > 0 && colon - line == giantLen && line[0] == 'q') {
+            if (strspn(line, "q") != (size_t)giantLen || atol(colon + 1) != o->giants) {
+                exact = 0;
+                break;
+            }
+            seen++;
+            continue;
+        }
+        long k = colon ? decodeWord(line, colon - line) : -1;
+        if (k < 0 || k >= vocab || atol(colon + 1) != counts[k]) {
+            exact = 0;
+            break;
+        }
+        seen++;
+    }
+    free(line);
+    return exact && seen == expectedDistinct && total == expectedTotal;
+}
+
+/*
+ * One run of the counter at the given thread count. Its output goes to
+ * temporary files; peak RSS comes from wait4 and the lock figures from
+ * the counter's --stats line.
+ */
+int runCounter(char **counterArgs, int numArgs, const char *corpus, int threads,
+               long *counts, const Options *o, RunResult *r) {
+    char outName[] = "/tmp/benchoutXXXXXX", errName[] = "/tmp/bencherrXXXXXX";
+    int out = mkstemp(outName), err = mkstemp(errName);
+    if (out < 0 || err < 0) {
+        perror("mkstemp");
+        return -1;
+    }
+    unlink(outName);
+    unlink(errName);
+
+    char threadArg[16];
+    snprintf(threadArg, sizeof(threadArg), "%d", threads);
+    char **argv = malloc((numArgs + 4) * sizeof(char *));
+    int n = 0;
+    argv[n++] = counterArgs[0];
+    argv[n++] = "--stats";
+    for (int i = 1; i < numArgs; i++)
+        argv[n++] = counterArgs[i];
+    argv[n++] = (char *)corpus;
+    argv[n++] = threadArg;
+    argv[n] = NULL;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, err, STDERR_FILENO);
+    double start = nowSeconds();
+    pid_t pid;
+    int rc = posix_spawn(&pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    free(argv);
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", counterArgs[0], strerror(rc));
+        return -1;
+    }
+    int status;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    r->seconds = nowSeconds() - start;
+    r->peakRSS = usage.ru_maxrss;
+
+    FILE *stats = fdopen(err, "r");
+    char line[256];
+    r->lockWaitNs = 0;
+    r->steals = 0;
+    rewind(stats);
+    while (fgets(line, sizeof(line), stats))
+        sscanf(line, "stats: steals=%ld lock_wait_ns=%ld", &r->steals, &r->lockWaitNs);
+    fclose(stats);
+
+    FILE *output = fdopen(out, "r");
+    rewind(output);
+    r->exact = WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+               checkCounts(output, counts, o);
+    fclose(output);
+    return 0;
+}
+
+void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-s size_mb] [-v vocab] [-z exponent] [-S seed] [-t max_threads]\n"
+            "          [-r repeat] [-k corpus_file] [-g giant_kb] <counter> [counter options...]\n",
+            name);
+}
+
+int main(int argc, char *argv[]) {
+    Options o = {64, 100000, 1.0, 42, (int)sysconf(_SC_NPROCESSORS_ONLN), 3, NULL, 0, 0};
+    static struct option longOptions[] = {
+        {"size", required_argument, NULL, 's'},
+        {"vocab", required_argument, NULL, 'v'},
+        {"zipf", required_argument, NULL, 'z'},
+        {"seed", required_argument, NULL, 'S'},
+        {"threads", required_argument, NULL, 't'},
+        {"repeat", required_argument, NULL, 'r'},
+        {"keep", required_argument, NULL, 'k'},
+        {"giant", required_argument, NULL, 'g'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    // '+' stops at the counter path so its own options pass through
+    while ((opt = getopt_long(argc, argv, "+s:v:z:S:t:r:k:g:", longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 's': o.sizeMB = atol(optarg); break;
+        case 'v': o.vocab = atol(optarg); break;
+        case 'z': o.exponent = atof(optarg); break;
+        case 'S': o.seed = strtoull(optarg, NULL, 10); break;
+        case 't': o.maxThreads = atoi(optarg); break;
+        case 'r': o.repeat = atoi(optarg); break;
+        case 'k': o.keep = optarg; break;
+        case 'g': o.giantKB = atol(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || o.sizeMB <= 0 || o.vocab <= 0 || o.maxThreads <= 0 ||
+        o.repeat <= 0 || o.giantKB < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char corpus[] = "/tmp/benchcorpusXXXXXX";
+    const char *corpusName = o.keep ? o.keep : corpus;
+    int fd = o.keep ? open(o.keep, O_WRONLY | O_CREAT | O_TRUNC, 0644) : mkstemp(corpus);
+    if (fd < 0) {
+        perror(corpusName);
+        return 1;
+    }
+    long *counts = calloc(o.vocab, sizeof(long));
+    if (!counts) {
+        perror("calloc");
+        return 1;
+    }
+    long bytes = generateCorpus(fd, &o, counts);
+    close(fd);
+    fprintf(stderr, "# corpus %s: %ld bytes, vocab %ld, zipf %.2f, seed %llu, giants %ld\n",
+            corpusName, bytes, o.vocab, o.exponent, (unsigned long long)o.seed, o.giants);
+
+    printf("threads,seconds,mb_per_s,speedup,lock_wait_ms,steals,peak_rss_kb,exact\n");
+    double base = 0;
+    int allExact = 1;
+    for (int t = 1; t <= o.maxThreads; t++) {
+        // Best of repeat runs; every run must be exact
+        RunResult best = {0}, r;
+        int exact = 1;
+        for (int i = 0; i < o.repeat; i++) {
+            if (runCounter(argv + optind, argc - optind, corpusName, t, counts, &o, &r) < 0)
+                return 1;
+            exact &= r.exact;
+            if (i == 0 || r.seconds < best.seconds)
+                best = r;
+        }
+        if (t == 1)
+            base = best.seconds;
+        printf("%d,%.4f,%.1f,%.2f,%.3f,%ld,%ld,%d\n", t, best.seconds,
+               bytes / 1048576.0 / best.seconds, base / best.seconds,
+               best.lockWaitNs / 1e6, best.steals, best.peakRSS, exact);
+        fflush(stdout);
+        allExact &= exact;
+    }
+
+    if (!o.keep)
+        unlink(corpus);
+    free(counts);
+    if (!allExact)
+        fprintf(stderr, "bench: counts differ from the generated corpus\n");
+    return allExact ? 0 : 1;
+}
@@ -3,115 +3,1658 @@
 #include <string.h>
 #include <ctype.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-#define MAX_WORDS 10000
-#define OVERLAP 100
-
-char *globalWords[MAX_WORDS];
-int globalCounts[MAX_WORDS];
-int globalWordCount = 0;
-pthread_mutex_t globalMutex = PTHREAD_MUTEX_INITIALIZER;
-char *buffer;
-
-void updateWord(const char *word) {
-    pthread_mutex_lock(&globalMutex);
-    for (int i = 0; i < globalWordCount; i++) {
-        if (strcmp(globalWords[i], word) == 0) {
-            globalCounts[i]++;
-            pthread_mutex_unlock(&globalMutex);
+#define INITIAL_TABLE_SIZE 1024
+#define TILE_SIZE (64 * 1024)
+#define MIN_CHUNK_SIZE (64 * 1024)
+#define MAX_CHUNK_SIZE (1024 * 1024)
+
+#define INITIAL_ARENA_SIZE (1024 * 1024)
+
+#define SEGMENT_SIZE (1024 * 1024)
+#define DEFAULT_READERS 2
+#define FILE_SHIFT 40   // first-seen keys are file index << FILE_SHIFT | offset
+
+// Word bytes interned back to back in one block; freed all at once
+typedef struct {
+    char *bytes;
+    long used;
+    long capacity;
+} StringArena;
+
+#define REF_SHIFT 48
+#define REF_OFFSET_MASK ((1UL << REF_SHIFT) - 1)
+
+/*
+ * One distinct word, 32 bytes. ref packs the arena the bytes were interned
+ * into (top 16 bits) with their offset there. first is the file offset of
+ * the first occurrence. len is 0 for an empty slot.
+ */
+typedef struct {
+    unsigned int hash;
+    unsigned int len;
+    unsigned long ref;
+    long count;
+    long first;
+} WordEntry;
+
+// Open-addressing hash table (linear probing, power-of-two capacity)
+typedef struct {
+    WordEntry *slots;
+    long capacity;
+    long size;
+    StringArena *arenas;    // picked by the high bits of WordEntry.ref (ref >> REF_SHIFT)
+    int source;             // arena new words are interned into
+} WordTable;
+
+// Mixes the word eight bytes at a time
+unsigned int hashWord(const char *word, int len) {
+    unsigned long h = len * 0x9E3779B97F4A7C15UL;
+    unsigned long k;
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&k, word + i, 8);
+        h = (h ^ k) * 0xFF51AFD7ED558CCDUL;
+        h ^= h >> 32;
+    }
+    if (i < len) {
+        k = 0;
+        memcpy(&k, word + i, len - i);
+        h = (h ^ k) * 0xFF51AFD7ED558CCDUL;
+    }
+    h ^= h >> 29;
+    h *= 0xC4CEB9FE1A85EC53UL;
+    return (unsigned int)(h >> 32);
+}
+
+/*
+ * Tokenizer kernels. Each one lowercases n bytes of src into dst and sets
+ * one bit per byte in spaces (bit i of word i / 64) where the byte is
+ * whitespace. Bits past n are set too, so a word never runs off the end.
+ * They match isspace() and tolower() in the C locale.
+ */
+typedef void (*ClassifyFn)(const char *src, char *dst, long n, uint64_t *spaces);
+
+void classifyScalar(const char *src, char *dst, long n, uint64_t *spaces) {
+    long blocks = (n + 63) / 64;
+    for (long b = 0; b < blocks; b++) {
+        uint64_t bits = 0;
+        for (int i = 0; i < 64; i++) {
+            long k = b * 64 + i;
+            if (k >= n) {
+                bits |= ~0UL << i;
+                break;
+            }
+            unsigned char c = src[k];
+            dst[k] = (unsigned char)(c - 'A') < 26 ? c + 32 : c;
+            if (c == ' ' || (unsigned char)(c - 9) < 5)
+                bits |= 1UL << i;
+        }
+        spaces[b] = bits;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+void classifySSE2(const char *src, char *dst, long n, uint64_t *spaces) {
+    const __m128i blank = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8(9);
+    const __m128i four = _mm_set1_epi8(4);
+    const __m128i upperA = _mm_set1_epi8('A');
+    const __m128i twentyFive = _mm_set1_epi8(25);
+    const __m128i caseBit = _mm_set1_epi8(0x20);
+    long full = n / 64;
+
+    for (long b = 0; b < full; b++) {
+        uint64_t bits = 0;
+        for (int i = 0; i < 4; i++) {
+            long k = b * 64 + i * 16;
+            __m128i v = _mm_loadu_si128((const __m128i *)(src + k));
+            // Unsigned x <= limit is min(x, limit) == x
+            __m128i ctl = _mm_sub_epi8(v, tab);
+            __m128i isSpace = _mm_or_si128(_mm_cmpeq_epi8(v, blank),
+                                           _mm_cmpeq_epi8(_mm_min_epu8(ctl, four), ctl));
+            __m128i letter = _mm_sub_epi8(v, upperA);
+            __m128i isUpper = _mm_cmpeq_epi8(_mm_min_epu8(letter, twentyFive), letter);
+            _mm_storeu_si128((__m128i *)(dst + k), _mm_add_epi8(v, _mm_and_si128(isUpper, caseBit)));
+            bits |= (uint64_t)(unsigned)_mm_movemask_epi8(isSpace) << (i * 16);
+        }
+        spaces[b] = bits;
+    }
+    if (full * 64 < n)
+        classifyScalar(src + full * 64, dst + full * 64, n - full * 64, spaces + full);
+}
+
+__attribute__((target("avx2")))
+void classifyAVX2(const char *src, char *dst, long n, uint64_t *spaces) {
+    const __m256i blank = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8(9);
+    const __m256i four = _mm256_set1_epi8(4);
+    const __m256i upperA = _mm256_set1_epi8('A');
+    const __m256i twentyFive = _mm256_set1_epi8(25);
+    const __m256i caseBit = _mm256_set1_epi8(0x20);
+    long full = n / 64;
+
+    for (long b = 0; b < full; b++) {
+        uint64_t bits = 0;
+        for (int i = 0; i < 2; i++) {
+            long k = b * 64 + i * 32;
+            __m256i v = _mm256_loadu_si256((const __m256i *)(src + k));
+            __m256i ctl = _mm256_sub_epi8(v, tab);
+            __m256i isSpace = _mm256_or_si256(_mm256_cmpeq_epi8(v, blank),
+                                              _mm256_cmpeq_epi8(_mm256_min_epu8(ctl, four), ctl));
+            __m256i letter = _mm256_sub_epi8(v, upperA);
+            __m256i isUpper = _mm256_cmpeq_epi8(_mm256_min_epu8(letter, twentyFive), letter);
+            _mm256_storeu_si256((__m256i *)(dst + k),
+                                _mm256_add_epi8(v, _mm256_and_si256(isUpper, caseBit)));
+            bits |= (uint64_t)(unsigned)_mm256_movemask_epi8(isSpace) << (i * 32);
+        }
+        spaces[b] = bits;
+    }
+    if (full * 64 < n)
+        classifyScalar(src + full * 64, dst + full * 64, n - full * 64, spaces + full);
+}
+#endif
+
+ClassifyFn classify = classifyScalar;
+
+void selectKernel() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        classify = classifyAVX2;
+    else if (__builtin_cpu_supports("sse2"))
+        classify = classifySSE2;
+#endif
+}
+
+// Index of the first byte at or after pos whose space bit equals want
+long nextBit(const uint64_t *spaces, long pos, long n, int want) {
+    while (pos < n) {
+        uint64_t bits = spaces[pos / 64];
+        if (!want)
+            bits = ~bits;
+        bits &= ~0UL << (pos % 64);
+        if (bits)
+            return (pos & ~63L) + __builtin_ctzl(bits);
+        pos = (pos & ~63L) + 64;
+    }
+    return n;
+}
+
+long internWord(StringArena *arena, const char *word, int len) {
+    if (arena->used + len > arena->capacity) {
+        long capacity = arena->capacity ? arena->capacity : INITIAL_ARENA_SIZE;
+        while (arena->used + len > capacity)
+            capacity *= 2;
+        char *bytes = realloc(arena->bytes, capacity);
+        if (!bytes) {
+            perror("realloc");
+            exit(1);
+        }
+        arena->bytes = bytes;
+        arena->capacity = capacity;
+    }
+    long offset = arena->used;
+    memcpy(arena->bytes + offset, word, len);
+    arena->used += len;
+    return offset;
+}
+
+const char *entryWord(WordTable *table, WordEntry *e) {
+    return table->arenas[e->ref >> REF_SHIFT].bytes + (e->ref & REF_OFFSET_MASK);
+}
+
+void initTable(WordTable *table, long capacity, StringArena *arenas, int source) {
+    table->slots = calloc(capacity, sizeof(WordEntry));
+    if (!table->slots) {
+        perror("calloc");
+        exit(1);
+    }
+    table->capacity = capacity;
+    table->size = 0;
+    table->arenas = arenas;
+    table->source = source;
+}
+
+WordEntry *findSlot(WordTable *table, const char *word, unsigned int len, unsigned int hash) {
+    long mask = table->capacity - 1;
+    long i = hash & mask;
+    while (table->slots[i].len != 0) {
+        WordEntry *e = &table->slots[i];
+        if (e->hash == hash && e->len == len && memcmp(entryWord(table, e), word, len) == 0)
+            return e;
+        i = (i + 1) & mask;
+    }
+    return &table->slots[i];
+}
+
+void growTable(WordTable *table) {
+    WordEntry *old = table->slots;
+    long oldCapacity = table->capacity;
+    initTable(table, oldCapacity * 2, table->arenas, table->source);
+    for (long i = 0; i < oldCapacity; i++) {
+        if (old[i].len == 0)
+            continue;
+        long j = old[i].hash & (table->capacity - 1);
+        while (table->slots[j].len != 0)
+            j = (j + 1) & (table->capacity - 1);
+        table->slots[j] = old[i];
+        table->size++;
+    }
+    free(old);
+}
+
+// Returns the entry for word, adding an empty one (count 0) if it is new
+WordEntry *lookupWord(WordTable *table, const char *word, unsigned int len, unsigned int hash) {
+    if ((table->size + 1) * 10 > table->capacity * 7)
+        growTable(table);
+    WordEntry *e = findSlot(table, word, len, hash);
+    if (e->len == 0) {
+        e->hash = hash;
+        e->len = len;
+        e->count = 0;
+        e->first = -1;
+        table->size++;
+    }
+    return e;
+}
+
+void updateWord(WordTable *table, const char *word, int len, long position) {
+    WordEntry *e = lookupWord(table, word, len, hashWord(word, len));
+    if (e->count == 0) {
+        long offset = internWord(&table->arenas[table->source], word, len);
+        e->ref = (unsigned long)table->source << REF_SHIFT | offset;
+        e->first = position;
+    } else if (position < e->first) {
+        // A stolen chunk can come before one this thread already counted
+        e->first = position;
+    }
+    e->count++;
+}
+
+// Folds an entry of another table in; its bytes stay in their own arena
+void mergeEntry(WordTable *table, WordEntry *from) {
+    WordEntry *e = lookupWord(table, entryWord(table, from), from->len, from->hash);
+    if (e->count == 0) {
+        *e = *from;
+        return;
+    }
+    e->count += from->count;
+    if (from->first < e->first)
+        e->first = from->first;
+}
+
+/*
+ * Space-Saving summary for --approx: at most capacity counters, so memory
+ * stays fixed however many distinct words the input has. A new word takes
+ * over the counter with the smallest count c and starts at c + 1 with an
+ * error of c. Counts never undercount; each one is at most error too high,
+ * and error is at most total / capacity. Each counter owns its key buffer.
+ */
+typedef struct {
+    char *key;
+    int len;
+    int keyCapacity;
+    unsigned int hash;
+    long count;
+    long error;
+    long first;
+} Counter;
+
+typedef struct {
+    Counter *counters;
+    int size;
+    int capacity;
+    int *heap;          // counter indices, min-heap on count
+    int *heapPos;       // where each counter sits in heap
+    int *index;         // open addressing, counter index or -1
+    int indexMask;
+    long total;         // words seen
+} SpaceSaving;
+
+void initSketch(SpaceSaving *s, int capacity) {
+    int slots = 1;
+    while (slots < capacity * 2)
+        slots *= 2;
+    s->counters = calloc(capacity, sizeof(Counter));
+    s->heap = malloc(capacity * sizeof(int));
+    s->heapPos = malloc(capacity * sizeof(int));
+    s->index = malloc(slots * sizeof(int));
+    if (!s->counters || !s->heap || !s->heapPos || !s->index) {
+        perror("malloc");
+        exit(1);
+    }
+    memset(s->index, -1, slots * sizeof(int));
+    s->indexMask = slots - 1;
+    s->size = 0;
+    s->capacity = capacity;
+    s->total = 0;
+}
+
+void freeSketch(SpaceSaving *s) {
+    for (int i = 0; i < s->size; i++)
+        free(s->counters[i].key);
+    free(s->counters);
+    free(s->heap);
+    free(s->heapPos);
+    free(s->index);
+}
+
+// Smallest count a word missing from the summary could have
+long sketchMin(SpaceSaving *s) {
+    return s->size == s->capacity ? s->counters[s->heap[0]].count : 0;
+}
+
+void heapSwap(SpaceSaving *s, int i, int j) {
+    int t = s->heap[i];
+    s->heap[i] = s->heap[j];
+    s->heap[j] = t;
+    s->heapPos[s->heap[i]] = i;
+    s->heapPos[s->heap[j]] = j;
+}
+
+void siftUp(SpaceSaving *s, int i) {
+    while (i > 0 && s->counters[s->heap[i]].count < s->counters[s->heap[(i - 1) / 2]].count) {
+        heapSwap(s, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+void siftDown(SpaceSaving *s, int i) {
+    while (1) {
+        int smallest = i;
+        int l = 2 * i + 1, r = l + 1;
+        if (l < s->size && s->counters[s->heap[l]].count < s->counters[s->heap[smallest]].count)
+            smallest = l;
+        if (r < s->size && s->counters[s->heap[r]].count < s->counters[s->heap[smallest]].count)
+            smallest = r;
+        if (smallest == i)
             return;
+        heapSwap(s, i, smallest);
+        i = smallest;
+    }
+}
+
+// Index slot holding word, or the empty slot where it would go
+int sketchSlot(SpaceSaving *s, const char *word, int len, unsigned int hash) {
+    int i = hash & s->indexMask;
+    while (s->index[i] >= 0) {
+        Counter *c = &s->counters[s->index[i]];
+        if (c->hash == hash && c->len == len && memcmp(c->key, word, len) == 0)
+            return i;
+        i = (i + 1) & s->indexMask;
+    }
+    return i;
+}
+
+// Removes a slot from the index, shifting later entries of its run back
+void sketchUnlink(SpaceSaving *s, int slot) {
+    int i = slot, j = slot;
+    while (1) {
+        j = (j + 1) & s->indexMask;
+        if (s->index[j] < 0)
+            break;
+        int home = s->counters[s->index[j]].hash & s->indexMask;
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+        s->index[i] = s->index[j];
+        i = j;
+    }
+    s->index[i] = -1;
+}
+
+void sketchWord(SpaceSaving *s, const char *word, int len, long position) {
+    unsigned int hash = hashWord(word, len);
+    int slot = sketchSlot(s, word, len, hash);
+    Counter *c;
+    s->total++;
+    if (s->index[slot] >= 0) {
+        int k = s->index[slot];
+        c = &s->counters[k];
+        c->count++;
+        if (position < c->first)
+            c->first = position;
+        siftDown(s, s->heapPos[k]);
+        return;
+    }
+
+    int k;
+    long floor = 0;
+    if (s->size < s->capacity) {
+        k = s->size++;
+        s->heap[k] = k;
+        s->heapPos[k] = k;
+    } else {
+        // Evict the smallest counter and hand it to the new word
+        k = s->heap[0];
+        c = &s->counters[k];
+        floor = c->count;
+        sketchUnlink(s, sketchSlot(s, c->key, c->len, c->hash));
+        slot = sketchSlot(s, word, len, hash);
+    }
+    c = &s->counters[k];
+    if (len > c->keyCapacity) {
+        free(c->key);
+        c->key = malloc(len);
+        if (!c->key) {
+            perror("malloc");
+            exit(1);
         }
+        c->keyCapacity = len;
+    }
+    memcpy(c->key, word, len);
+    c->len = len;
+    c->hash = hash;
+    c->count = floor + 1;
+    c->error = floor;
+    c->first = position;
+    s->index[slot] = k;
+    siftUp(s, s->heapPos[k]);
+    siftDown(s, s->heapPos[k]);
+}
+
+// Per-thread tile buffers for the tokenizer kernels
+typedef struct {
+    char *lower;
+    uint64_t *spaces;
+    long size;
+} Scratch;
+
+void growScratch(Scratch *scratch, long size) {
+    free(scratch->lower);
+    free(scratch->spaces);
+    scratch->lower = malloc(size);
+    scratch->spaces = malloc((size / 64 + 1) * sizeof(uint64_t));
+    if (!scratch->lower || !scratch->spaces) {
+        perror("malloc");
+        exit(1);
     }
-    if (globalWordCount < MAX_WORDS) {
-        globalWords[globalWordCount] = strdup(word);
-        globalCounts[globalWordCount] = 1;
-        globalWordCount++;
+    scratch->size = size;
+}
+
+/*
+ * Counts the words of data[from, to) that start before limit. from must
+ * be at a word boundary. The range is lowercased and classified one tile
+ * at a time, and each tile is cut back to its last whitespace byte so
+ * words are hashed in one piece straight out of the tile. Words go to
+ * sketch when there is one, to the exact table otherwise.
+ */
+void tokenizeRange(WordTable *table, SpaceSaving *sketch, Scratch *scratch, const char *data,
+                   long from, long to, long limit, long base) {
+    long tile = from;
+    long slack = 64;    // how far past limit a tile may reach; only ever grows
+    while (tile < to && tile < limit) {
+        long n = limit - tile + slack;  // always > slack, since tile < limit
+        if (n > scratch->size)
+            n = scratch->size;
+        if (n > to - tile)
+            n = to - tile;
+        classify(data + tile, scratch->lower, n, scratch->spaces);
+        if (tile + n < to && !(scratch->spaces[(n - 1) / 64] >> ((n - 1) % 64) & 1)) {
+            long cut = n - 1;
+            while (cut >= 0 && !(scratch->spaces[cut / 64] >> (cut % 64) & 1))
+                cut--;
+            if (cut < 0) {
+                // A single word fills the tile: retry with one twice as long
+                if (2 * n > scratch->size)
+                    growScratch(scratch, 2 * n);
+                if (tile + 2 * n - limit > slack)
+                    slack = tile + 2 * n - limit;
+                continue;
+            }
+            n = cut + 1;
+        }
+        long pos = 0;
+        while (1) {
+            long start = nextBit(scratch->spaces, pos, n, 0);
+            if (start >= n || tile + start >= limit)
+                break;
+            long end = nextBit(scratch->spaces, start, n, 1);
+            if (sketch)
+                sketchWord(sketch, scratch->lower + start, end - start, base + tile + start);
+            else
+                updateWord(table, scratch->lower + start, end - start, base + tile + start);
+            pos = end;
+        }
+        tile += n;
     }
-    pthread_mutex_unlock(&globalMutex);
 }
 
+// Locks m, adding any time spent blocked on it to *waited (nanoseconds)
+void lockTimed(pthread_mutex_t *m, long *waited) {
+    if (pthread_mutex_trylock(m) == 0)
+        return;
+    struct timespec from, to;
+    clock_gettime(CLOCK_MONOTONIC, &from);
+    pthread_mutex_lock(m);
+    clock_gettime(CLOCK_MONOTONIC, &to);
+    *waited += (to.tv_sec - from.tv_sec) * 1000000000L + (to.tv_nsec - from.tv_nsec);
+}
+
+/*
+ * Chunk indices still owed to one worker. The owner takes chunks from
+ * the head, in file order. Idle workers steal single chunks from the tail.
+ */
 typedef struct {
-    long start;
-    long end;
+    pthread_mutex_t lock;
+    long head;
+    long tail;
+} ChunkDeque;
+
+typedef struct ThreadArg {
+    const char *data;   // text being counted (not NUL-terminated)
+    long size;          // bytes in data
+    long base;          // file offset of data[0]
+    long chunkSize;
+    int id;
+    int numThreads;
+    struct ThreadArg *all;
+    ChunkDeque deque;
+    long steals;
+    long lockWait;      // nanoseconds blocked on deque locks
+    WordTable table;
+    SpaceSaving *sketch;    // NULL unless --approx
+    Scratch scratch;
+    struct Pipeline *pipeline;  // multi-file mode only
 } ThreadArg;
 
+// Each merger owns the words whose hash falls in its partition
+typedef struct {
+    ThreadArg *sources;
+    int numSources;
+    int partition;
+    int numPartitions;
+    WordTable table;
+    int topK;           // 0 keeps every word
+    WordEntry **top;    // best topK of the partition, best first
+    long numTop;
+} MergeArg;
+
+// Partitions come from a remix of the hash, not the low bits used for slots
+int partitionOf(unsigned int hash, int numPartitions) {
+    return (int)(((hash * 0x9E3779B1U) >> 16) % numPartitions);
+}
+
+// Orders by count, highest first, then by first occurrence
+int outranks(WordEntry *a, WordEntry *b) {
+    return a->count > b->count || (a->count == b->count && a->first < b->first);
+}
+
+int compareRank(const void *a, const void *b) {
+    WordEntry *x = *(WordEntry **)a, *y = *(WordEntry **)b;
+    return outranks(y, x) - outranks(x, y);
+}
+
+// Picks the k best entries with a min-heap whose root is the worst kept
+long selectTop(WordTable *table, int k, WordEntry **top) {
+    long n = 0;
+    for (long i = 0; i < table->capacity; i++) {
+        WordEntry *e = &table->slots[i];
+        if (e->len == 0)
+            continue;
+        if (n < k) {
+            long j = n++;
+            while (j > 0 && outranks(top[(j - 1) / 2], e)) {
+                top[j] = top[(j - 1) / 2];
+                j = (j - 1) / 2;
+            }
+            top[j] = e;
+        } else if (outranks(e, top[0])) {
+            long j = 0;
+            while (1) {
+                long worst = j;
+                WordEntry *w = e;
+                for (long c = 2 * j + 1; c <= 2 * j + 2 && c < n; c++) {
+                    if (outranks(w, top[c])) {
+                        worst = c;
+                        w = top[c];
+                    }
+                }
+                if (worst == j)
+                    break;
+                top[j] = top[worst];
+                j = worst;
+            }
+            top[j] = e;
+        }
+    }
+    qsort(top, n, sizeof(WordEntry *), compareRank);
+    return n;
+}
+
+void *merger(void *arg) {
+    MergeArg *m = (MergeArg *)arg;
+    initTable(&m->table, INITIAL_TABLE_SIZE, m->sources[0].table.arenas, -1);
+    for (int t = 0; t < m->numSources; t++) {
+        WordTable *src = &m->sources[t].table;
+        for (long i = 0; i < src->capacity; i++) {
+            WordEntry *e = &src->slots[i];
+            if (e->len == 0 || partitionOf(e->hash, m->numPartitions) != m->partition)
+                continue;
+            mergeEntry(&m->table, e);
+        }
+    }
+    if (m->topK > 0) {
+        m->top = malloc(m->topK * sizeof(WordEntry *));
+        if (!m->top) {
+            perror("malloc");
+            exit(1);
+        }
+        m->numTop = selectTop(&m->table, m->topK, m->top);
+    }
+    return NULL;
+}
+
+int compareFirst(const void *a, const void *b) {
+    long x = (*(WordEntry **)a)->first, y = (*(WordEntry **)b)->first;
+    return (x > y) - (x < y);
+}
+
+// One counter of a thread's summary, tagged with the thread it came from
+typedef struct {
+    Counter *counter;
+    int owner;
+} SketchItem;
+
+int compareKey(const void *a, const void *b) {
+    Counter *x = ((SketchItem *)a)->counter, *y = ((SketchItem *)b)->counter;
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    if (x->len != y->len)
+        return x->len - y->len;
+    return memcmp(x->key, y->key, x->len);
+}
+
+int compareCount(const void *a, const void *b) {
+    const Counter *x = a, *y = b;
+    if (x->count != y->count)
+        return x->count > y->count ? -1 : 1;
+    return (x->first > y->first) - (x->first < y->first);
+}
+
+/*
+ * Combines the per-thread summaries into one list, best first. A word
+ * missing from a full summary may still have occurred up to that summary's
+ * minimum count times there, so the minimum is added to both its count and
+ * its error. Merged errors are thus at most the sum of the minimums, which
+ * is at most total / capacity. Keys still point into the thread summaries.
+ */
+long mergeSketches(ThreadArg *args, int numThreads, Counter **merged) {
+    long n = 0, sumMin = 0;
+    long *minOf = malloc(numThreads * sizeof(long));
+    for (int t = 0; t < numThreads; t++) {
+        n += args[t].sketch->size;
+        minOf[t] = sketchMin(args[t].sketch);
+        sumMin += minOf[t];
+    }
+    SketchItem *items = malloc((n + 1) * sizeof(SketchItem));
+    *merged = malloc((n + 1) * sizeof(Counter));
+    if (!minOf || !items || !*merged) {
+        perror("malloc");
+        exit(1);
+    }
+    long k = 0;
+    for (int t = 0; t < numThreads; t++)
+        for (int i = 0; i < args[t].sketch->size; i++) {
+            items[k].counter = &args[t].sketch->counters[i];
+            items[k++].owner = t;
+        }
+    qsort(items, n, sizeof(SketchItem), compareKey);
+
+    long out = 0;
+    for (long i = 0; i < n;) {
+        Counter c = *items[i].counter;
+        long missing = sumMin - minOf[items[i].owner];
+        long j = i + 1;
+        for (; j < n && compareKey(&items[i], &items[j]) == 0; j++) {
+            Counter *d = items[j].counter;
+            c.count += d->count;
+            c.error += d->error;
+            if (d->first < c.first)
+                c.first = d->first;
+            missing -= minOf[items[j].owner];
+        }
+        c.count += missing;
+        c.error += missing;
+        (*merged)[out++] = c;
+        i = j;
+    }
+    qsort(*merged, out, sizeof(Counter), compareCount);
+    free(items);
+    free(minOf);
+    return out;
+}
+
+long popChunk(ChunkDeque *deque, long *waited) {
+    long chunk = -1;
+    lockTimed(&deque->lock, waited);
+    if (deque->head < deque->tail)
+        chunk = deque->head++;
+    pthread_mutex_unlock(&deque->lock);
+    return chunk;
+}
+
+long stealChunk(ChunkDeque *deque, long *waited) {
+    long chunk = -1;
+    lockTimed(&deque->lock, waited);
+    if (deque->head < deque->tail)
+        chunk = --deque->tail;
+    pthread_mutex_unlock(&deque->lock);
+    return chunk;
+}
+
+/*
+ * A word belongs to the chunk it starts in. The chunk skips the tail of a
+ * word that began before it, and reads past its own end to finish its
+ * last word, however long that word is.
+ */
+void countChunk(ThreadArg *a, long chunk) {
+    long pos = chunk * a->chunkSize;
+    long end = pos + a->chunkSize < a->size ? pos + a->chunkSize : a->size;
+    if (pos > 0 && !isspace((unsigned char)a->data[pos - 1])) {
+        while (pos < end && !isspace((unsigned char)a->data[pos]))
+            pos++;
+    }
+    tokenizeRange(&a->table, a->sketch, &a->scratch, a->data, pos, a->size, end, a->base);
+}
+
 void *worker(void *arg) {
     ThreadArg *a = (ThreadArg *)arg;
-    long pos = a->start;
-    long originalEnd = a->end;
-    long fileSize = strlen(buffer);
-    long extendedEnd = (a->end + OVERLAP < fileSize) ? a->end + OVERLAP : fileSize;
+    while (1) {
+        long chunk = popChunk(&a->deque, &a->lockWait);
+        for (int k = 1; chunk < 0 && k < a->numThreads; k++) {
+            chunk = stealChunk(&a->all[(a->id + k) % a->numThreads].deque, &a->lockWait);
+            if (chunk >= 0)
+                a->steals++;
+        }
+        if (chunk < 0)
+            break;
+        countChunk(a, chunk);
+    }
+    return NULL;
+}
 
-    if (pos > 0) {
-        while (pos < extendedEnd && !isspace(buffer[pos]))
-            pos++;
+/*
+ * Cuts data into small chunks, deals each worker a contiguous run of
+ * them, and lets workers that run dry steal from the others.
+ */
+void countBuffer(const char *data, long size, long base,
+                 ThreadArg *args, pthread_t *threads, int numThreads) {
+    long chunkSize = size / (numThreads * 8L);
+    if (chunkSize < MIN_CHUNK_SIZE)
+        chunkSize = MIN_CHUNK_SIZE;
+    if (chunkSize > MAX_CHUNK_SIZE)
+        chunkSize = MAX_CHUNK_SIZE;
+    long numChunks = (size + chunkSize - 1) / chunkSize;
+    for (int i = 0; i < numThreads; i++) {
+        args[i].data = data;
+        args[i].size = size;
+        args[i].base = base;
+        args[i].chunkSize = chunkSize;
+        args[i].id = i;
+        args[i].numThreads = numThreads;
+        args[i].all = args;
+        args[i].deque.head = numChunks * i / numThreads;
+        args[i].deque.tail = numChunks * (i + 1) / numThreads;
     }
-    while (pos < extendedEnd) {
-        while (pos < extendedEnd && isspace(buffer[pos]))
-            pos++;
-        if (pos >= extendedEnd)
+    for (int i = 0; i < numThreads; i++)
+        pthread_create(&threads[i], NULL, worker, &args[i]);
+    for (int i = 0; i < numThreads; i++)
+        pthread_join(threads[i], NULL);
+}
+
+/*
+ * Streaming mode: reads the file through a fixed window instead of
+ * mapping all of it. Each window is cut after its last whitespace byte
+ * and the unfinished word is carried to the front of the next one, so
+ * no word is ever split. The window only grows when a single word is
+ * longer than it. Reading starts at fd's current offset, which is start;
+ * returns the offset reading stopped at, or -1.
+ */
+long countStream(int fd, long start, long window, ThreadArg *args, pthread_t *threads,
+                 int numThreads) {
+    char *buf = malloc(window);
+    long carry = 0;     // bytes of an unfinished word at the front of buf
+    long base = start;  // file offset of buf[0]
+    int eof = 0;
+
+    if (!buf) {
+        perror("malloc");
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while (!eof) {
+        long avail = carry;
+        while (avail < window) {
+            ssize_t n = read(fd, buf + avail, window - avail);
+            if (n < 0) {
+                perror("read");
+                free(buf);
+                return -1;
+            }
+            if (n == 0) {
+                eof = 1;
+                break;
+            }
+            avail += n;
+        }
+
+        long cut = avail;
+        if (!eof) {
+            while (cut > 0 && !isspace((unsigned char)buf[cut - 1]))
+                cut--;
+            if (cut == 0) {
+                // One word fills the whole window: widen it and read on
+                char *bigger = realloc(buf, window * 2);
+                if (!bigger) {
+                    perror("realloc");
+                    free(buf);
+                    return -1;
+                }
+                buf = bigger;
+                window *= 2;
+                carry = avail;
+                continue;
+            }
+        }
+
+        countBuffer(buf, cut, base, args, threads, numThreads);
+        memmove(buf, buf + cut, avail - cut);
+        carry = avail - cut;
+        base += cut;
+    }
+    free(buf);
+    return base;
+}
+
+/*
+ * Multi-file mode runs as a pipeline. Reader threads open the files and
+ * read them into segments drawn from a fixed pool, and tokenizer threads
+ * count each filled segment into their own table. Reads overlap with
+ * counting, and the pool bounds how far the readers can run ahead. A file
+ * larger than a segment is cut after its last whitespace byte and the
+ * unfinished word is carried into the next segment, as in countStream.
+ */
+typedef struct {
+    char *data;
+    long size;
+    long capacity;
+    long base;          // first-seen key of data[0]
+} Segment;
+
+typedef struct Pipeline {
+    pthread_mutex_t lock;
+    pthread_cond_t freed;       // a segment went back to the pool
+    pthread_cond_t filled;      // a segment is ready, or the readers are done
+    Segment *segments;
+    Segment **pool;             // free segments
+    int numFree;
+    Segment **ready;            // ring of filled segments, oldest at head
+    int head;
+    int numReady;
+    int numSegments;
+    int readersLeft;
+    char **paths;
+    int numPaths;
+    int nextPath;
+    long lockWait;              // nanoseconds blocked on lock, added under it
+} Pipeline;
+
+Segment *takeSegment(Pipeline *p) {
+    lockTimed(&p->lock, &p->lockWait);
+    while (p->numFree == 0)
+        pthread_cond_wait(&p->freed, &p->lock);
+    Segment *seg = p->pool[--p->numFree];
+    pthread_mutex_unlock(&p->lock);
+    seg->size = 0;
+    return seg;
+}
+
+void giveSegment(Pipeline *p, Segment *seg) {
+    lockTimed(&p->lock, &p->lockWait);
+    p->pool[p->numFree++] = seg;
+    pthread_cond_signal(&p->freed);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pushSegment(Pipeline *p, Segment *seg) {
+    lockTimed(&p->lock, &p->lockWait);
+    p->ready[(p->head + p->numReady++) % p->numSegments] = seg;
+    pthread_cond_signal(&p->filled);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Next filled segment, or NULL once the readers are done and all is counted
+Segment *popSegment(Pipeline *p) {
+    Segment *seg = NULL;
+    lockTimed(&p->lock, &p->lockWait);
+    while (p->numReady == 0 && p->readersLeft > 0)
+        pthread_cond_wait(&p->filled, &p->lock);
+    if (p->numReady > 0) {
+        seg = p->ready[p->head];
+        p->head = (p->head + 1) % p->numSegments;
+        p->numReady--;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return seg;
+}
+
+void growSegment(Segment *seg, long capacity) {
+    char *data = realloc(seg->data, capacity);
+    if (!data) {
+        perror("realloc");
+        exit(1);
+    }
+    seg->data = data;
+    seg->capacity = capacity;
+}
+
+void readFile(Pipeline *p, long file) {
+    const char *path = p->paths[file];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    Segment *seg = takeSegment(p);
+    long offset = 0;    // file offset of seg->data[0]
+    while (1) {
+        ssize_t n = read(fd, seg->data + seg->size, seg->capacity - seg->size);
+        if (n < 0) {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
             break;
-        long wordStart = pos;
-        long wordEnd = pos;
-        while (wordEnd < extendedEnd && !isspace(buffer[wordEnd]))
-            wordEnd++;
-        if (wordStart < originalEnd) {
-            int len = wordEnd - wordStart;
-            char *word = malloc(len + 1);
-            strncpy(word, buffer + wordStart, len);
-            word[len] = '\0';
-            for (int k = 0; k < len; k++)
-                word[k] = tolower(word[k]);
-            updateWord(word);
-            free(word);
         }
-        pos = wordEnd;
+        if (n == 0)
+            break;
+        seg->size += n;
+        if (seg->size < seg->capacity)
+            continue;
+
+        long cut = seg->size;
+        while (cut > 0 && !isspace((unsigned char)seg->data[cut - 1]))
+            cut--;
+        if (cut == 0) {
+            // One word fills the whole segment: widen it and read on
+            growSegment(seg, seg->capacity * 2);
+            continue;
+        }
+        Segment *next = takeSegment(p);
+        if (next->capacity < seg->size - cut)
+            growSegment(next, seg->capacity);
+        memcpy(next->data, seg->data + cut, seg->size - cut);
+        next->size = seg->size - cut;
+        seg->size = cut;
+        seg->base = file << FILE_SHIFT | offset;
+        pushSegment(p, seg);
+        offset += cut;
+        seg = next;
+    }
+    close(fd);
+    seg->base = file << FILE_SHIFT | offset;
+    if (seg->size > 0)
+        pushSegment(p, seg);
+    else
+        giveSegment(p, seg);
+}
+
+void *reader(void *arg) {
+    Pipeline *p = (Pipeline *)arg;
+    while (1) {
+        lockTimed(&p->lock, &p->lockWait);
+        long file = p->nextPath < p->numPaths ? p->nextPath++ : -1;
+        pthread_mutex_unlock(&p->lock);
+        if (file < 0)
+            break;
+        readFile(p, file);
+    }
+    lockTimed(&p->lock, &p->lockWait);
+    p->readersLeft--;
+    pthread_cond_broadcast(&p->filled);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+void *tokenizer(void *arg) {
+    ThreadArg *a = (ThreadArg *)arg;
+    Segment *seg;
+    while ((seg = popSegment(a->pipeline)) != NULL) {
+        tokenizeRange(&a->table, a->sketch, &a->scratch, seg->data, 0, seg->size,
+                      seg->size, seg->base);
+        giveSegment(a->pipeline, seg);
+    }
+    return NULL;
+}
+
+int compareName(const void *a, const void *b) {
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+// Regular files of a directory, sorted by name
+char **listDirectory(const char *name, int *count) {
+    DIR *dir = opendir(name);
+    if (!dir) {
+        perror(name);
+        return NULL;
+    }
+    int n = 0, capacity = 64;
+    char **paths = malloc(capacity * sizeof(char *));
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        char *path = malloc(strlen(name) + strlen(entry->d_name) + 2);
+        sprintf(path, "%s/%s", name, entry->d_name);
+        struct stat st;
+        if (entry->d_type != DT_REG &&
+            (entry->d_type != DT_UNKNOWN || stat(path, &st) < 0 || !S_ISREG(st.st_mode))) {
+            free(path);
+            continue;
+        }
+        if (n == capacity) {
+            capacity *= 2;
+            paths = realloc(paths, capacity * sizeof(char *));
+        }
+        paths[n++] = path;
+    }
+    closedir(dir);
+    qsort(paths, n, sizeof(char *), compareName);
+    *count = n;
+    return paths;
+}
+
+// One path per line; blank lines are skipped
+char **readList(const char *name, int *count) {
+    FILE *list = fopen(name, "r");
+    if (!list) {
+        perror(name);
+        return NULL;
+    }
+    int n = 0, capacity = 64;
+    char **paths = malloc(capacity * sizeof(char *));
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &size, list)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        if (n == capacity) {
+            capacity *= 2;
+            paths = realloc(paths, capacity * sizeof(char *));
+        }
+        paths[n++] = strdup(line);
+    }
+    free(line);
+    fclose(list);
+    *count = n;
+    return paths;
+}
+
+// Returns the time threads spent blocked on the pipeline lock
+long countFiles(char **paths, int numPaths, long segmentSize, int numReaders,
+                ThreadArg *args, pthread_t *threads, int numThreads) {
+    Pipeline p;
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.freed, NULL);
+    pthread_cond_init(&p.filled, NULL);
+    // A reader holds at most two segments, so this never runs dry for good
+    p.numSegments = 2 * (numReaders + numThreads);
+    p.segments = calloc(p.numSegments, sizeof(Segment));
+    p.pool = malloc(p.numSegments * sizeof(Segment *));
+    p.ready = malloc(p.numSegments * sizeof(Segment *));
+    if (!p.segments || !p.pool || !p.ready) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < p.numSegments; i++) {
+        growSegment(&p.segments[i], segmentSize);
+        p.pool[i] = &p.segments[i];
+    }
+    p.numFree = p.numSegments;
+    p.head = 0;
+    p.numReady = 0;
+    p.readersLeft = numReaders;
+    p.paths = paths;
+    p.numPaths = numPaths;
+    p.nextPath = 0;
+    p.lockWait = 0;
+
+    pthread_t *readers = malloc(numReaders * sizeof(pthread_t));
+    for (int i = 0; i < numReaders; i++)
+        pthread_create(&readers[i], NULL, reader, &p);
+    for (int i = 0; i < numThreads; i++) {
+        args[i].pipeline = &p;
+        pthread_create(&threads[i], NULL, tokenizer, &args[i]);
+    }
+    for (int i = 0; i < numReaders; i++)
+        pthread_join(readers[i], NULL);
+    for (int i = 0; i < numThreads; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < p.numSegments; i++)
+        free(p.segments[i].data);
+    free(p.segments);
+    free(p.pool);
+    free(p.ready);
+    free(readers);
+    pthread_cond_destroy(&p.freed);
+    pthread_cond_destroy(&p.filled);
+    pthread_mutex_destroy(&p.lock);
+    return p.lockWait;
+}
+
+/*
+ * --index FILE keeps the counts of a source between runs so an appended
+ * file only has its new tail counted. The index is meant to be mapped as
+ * is: a header, the entries sorted by word, an open-addressing table of
+ * entry numbers (plus one, 0 for empty) keyed by hashWord, and the word
+ * bytes. A source that did not end in whitespace may have had its last
+ * word cut short, so the next run takes that word back out and counts
+ * again from where it started.
+ *
+ * Only the reading and tokenizing of the source is incremental. Every run
+ * still copies the whole vocabulary out of the mapped index into a table
+ * (loadIndex) and writes the whole index back out (writeIndex), so a run
+ * costs time proportional to the number of distinct words as well as to
+ * the appended bytes. That pays off while the source is much larger than
+ * its vocabulary, which is the usual case for text; a source of mostly
+ * unique tokens gains little from --index.
+ */
+#define INDEX_MAGIC "WCINDEX1"
+#define FINGERPRINT_SIZE 4096
+
+typedef struct {
+    char magic[8];
+    uint64_t device;        // identity of the source
+    uint64_t inode;
+    uint64_t processed;     // bytes of the source counted
+    uint64_t tailStart;     // last word, if the source did not end in whitespace
+    uint64_t tailLen;
+    uint32_t fingerprint;   // hashWord of the first FINGERPRINT_SIZE bytes
+    uint32_t unused;
+    uint64_t numWords;
+    uint64_t numSlots;
+    uint64_t bytesSize;
+} IndexHeader;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t len;
+    uint64_t offset;        // into the word bytes
+    int64_t count;
+    int64_t first;
+} IndexEntry;
+
+typedef struct {
+    char *map;
+    long size;
+    IndexHeader *header;
+    IndexEntry *entries;
+    uint32_t *slots;
+    char *bytes;
+} IndexView;
+
+uint32_t fingerprint(int fd, long size) {
+    char buf[FINGERPRINT_SIZE];
+    long n = size < FINGERPRINT_SIZE ? size : FINGERPRINT_SIZE;
+    if (pread(fd, buf, n, 0) != n)
+        return 0;
+    return hashWord(buf, n);
+}
+
+// Maps an index and checks it still describes the source; 0 if not
+int openIndex(const char *name, int fd, IndexView *view) {
+    struct stat st, src;
+    int ifd = open(name, O_RDONLY);
+    if (ifd < 0)
+        return 0;
+    if (fstat(ifd, &st) < 0 || st.st_size < (long)sizeof(IndexHeader) || fstat(fd, &src) < 0) {
+        close(ifd);
+        return 0;
+    }
+    view->size = st.st_size;
+    view->map = mmap(NULL, view->size, PROT_READ, MAP_PRIVATE, ifd, 0);
+    close(ifd);
+    if (view->map == MAP_FAILED)
+        return 0;
+    IndexHeader *h = view->header = (IndexHeader *)view->map;
+    uint64_t need = sizeof(IndexHeader) + h->numWords * sizeof(IndexEntry)
+        + h->numSlots * sizeof(uint32_t) + h->bytesSize;
+    if (memcmp(h->magic, INDEX_MAGIC, 8) != 0 || need != (uint64_t)view->size ||
+        h->device != (uint64_t)src.st_dev || h->inode != (uint64_t)src.st_ino ||
+        h->processed > (uint64_t)src.st_size ||
+        h->fingerprint != fingerprint(fd, h->processed)) {
+        munmap(view->map, view->size);
+        return 0;
+    }
+    view->entries = (IndexEntry *)(h + 1);
+    view->slots = (uint32_t *)(view->entries + h->numWords);
+    view->bytes = (char *)(view->slots + h->numSlots);
+    return 1;
+}
+
+IndexEntry *indexLookup(IndexView *view, const char *word, int len) {
+    uint32_t hash = hashWord(word, len);
+    uint64_t mask = view->header->numSlots - 1;
+    for (uint64_t i = hash & mask; view->slots[i] != 0; i = (i + 1) & mask) {
+        IndexEntry *e = &view->entries[view->slots[i] - 1];
+        if (e->hash == hash && e->len == (uint32_t)len &&
+            memcmp(view->bytes + e->offset, word, len) == 0)
+            return e;
     }
     return NULL;
 }
 
+/*
+ * Loads the counts of an index into table, less one for the last word if
+ * it is about to be counted again. Returns where counting should resume.
+ */
+long loadIndex(IndexView *view, int fd, WordTable *table) {
+    IndexHeader *h = view->header;
+    IndexEntry *tail = NULL;
+    if (h->tailLen > 0) {
+        char *word = malloc(h->tailLen);
+        if (!word || pread(fd, word, h->tailLen, h->tailStart) != (ssize_t)h->tailLen) {
+            free(word);
+            return 0;
+        }
+        for (uint64_t i = 0; i < h->tailLen; i++)
+            word[i] = tolower((unsigned char)word[i]);
+        tail = indexLookup(view, word, h->tailLen);
+        free(word);
+        if (!tail)
+            return 0;
+    }
+    long capacity = INITIAL_TABLE_SIZE;
+    while (capacity * 7 < (long)h->numWords * 10)
+        capacity *= 2;
+    free(table->slots);
+    initTable(table, capacity, table->arenas, table->source);
+    for (uint64_t i = 0; i < h->numWords; i++) {
+        IndexEntry *from = &view->entries[i];
+        long count = from->count - (from == tail);
+        if (count == 0)
+            continue;
+        const char *word = view->bytes + from->offset;
+        WordEntry *e = lookupWord(table, word, from->len, from->hash);
+        long offset = internWord(&table->arenas[table->source], word, from->len);
+        e->ref = (unsigned long)table->source << REF_SHIFT | offset;
+        e->count = count;
+        e->first = from->first;
+    }
+    return tail ? (long)h->tailStart : (long)h->processed;
+}
+
+// Start of the word running up to end, or end if the source ends in whitespace
+long tailWordStart(int fd, long end) {
+    char buf[4096];
+    long pos = end;
+    while (pos > 0) {
+        long n = pos < (long)sizeof(buf) ? pos : (long)sizeof(buf);
+        if (pread(fd, buf, n, pos - n) != n)
+            return end;
+        for (long i = n - 1; i >= 0; i--, pos--)
+            if (isspace((unsigned char)buf[i]))
+                return pos;
+    }
+    return 0;
+}
+
+typedef struct {
+    const char *word;
+    WordEntry *entry;
+} IndexItem;
+
+int compareWord(const void *a, const void *b) {
+    const IndexItem *x = a, *y = b;
+    int len = x->entry->len < y->entry->len ? x->entry->len : y->entry->len;
+    int c = memcmp(x->word, y->word, len);
+    if (c != 0)
+        return c;
+    return (x->entry->len > y->entry->len) - (x->entry->len < y->entry->len);
+}
+
+// Writes the merged counts to a temporary file and renames it over name
+int writeIndex(const char *name, int fd, long processed, MergeArg *merges, int numPartitions) {
+    struct stat src;
+    if (fstat(fd, &src) < 0) {
+        perror("fstat");
+        return -1;
+    }
+    IndexHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INDEX_MAGIC, 8);
+    h.device = src.st_dev;
+    h.inode = src.st_ino;
+    h.processed = processed;
+    h.tailStart = tailWordStart(fd, processed);
+    h.tailLen = processed - h.tailStart;
+    h.fingerprint = fingerprint(fd, processed);
+    for (int i = 0; i < numPartitions; i++)
+        h.numWords += merges[i].table.size;
+    h.numSlots = 2;
+    while (h.numSlots < h.numWords * 2)
+        h.numSlots *= 2;
+
+    IndexItem *items = malloc((h.numWords + 1) * sizeof(IndexItem));
+    IndexEntry *entries = malloc((h.numWords + 1) * sizeof(IndexEntry));
+    uint32_t *slots = calloc(h.numSlots, sizeof(uint32_t));
+    if (!items || !entries || !slots) {
+        perror("malloc");
+        exit(1);
+    }
+    long n = 0;
+    for (int i = 0; i < numPartitions; i++)
+        for (long j = 0; j < merges[i].table.capacity; j++) {
+            WordEntry *e = &merges[i].table.slots[j];
+            if (e->len == 0)
+                continue;
+            items[n].word = entryWord(&merges[i].table, e);
+            items[n++].entry = e;
+        }
+    qsort(items, n, sizeof(IndexItem), compareWord);
+    for (long i = 0; i < n; i++) {
+        WordEntry *e = items[i].entry;
+        entries[i].hash = e->hash;
+        entries[i].len = e->len;
+        entries[i].offset = h.bytesSize;
+        entries[i].count = e->count;
+        entries[i].first = e->first;
+        h.bytesSize += e->len;
+        uint64_t k = e->hash & (h.numSlots - 1);
+        while (slots[k] != 0)
+            k = (k + 1) & (h.numSlots - 1);
+        slots[k] = i + 1;
+    }
+
+    char *tmp = malloc(strlen(name) + 5);
+    sprintf(tmp, "%s.tmp", name);
+    FILE *out = fopen(tmp, "wb");
+    if (!out) {
+        perror(tmp);
+        free(tmp);
+        free(items);
+        free(entries);
+        free(slots);
+        return -1;
+    }
+    fwrite(&h, sizeof(h), 1, out);
+    fwrite(entries, sizeof(IndexEntry), n, out);
+    fwrite(slots, sizeof(uint32_t), h.numSlots, out);
+    for (long i = 0; i < n; i++)
+        fwrite(items[i].word, 1, items[i].entry->len, out);
+    int failed = ferror(out);
+    if (fclose(out) != 0 || failed || rename(tmp, name) < 0) {
+        perror(name);
+        unlink(tmp);
+        failed = 1;
+    }
+    free(tmp);
+    free(items);
+    free(entries);
+    free(slots);
+    return failed ? -1 : 0;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 3) {
-        printf("Usage: %s <filename> <num_threads>\n", argv[0]);
+    long window = 0;
+    int topK = 0;
+    int approx = 0;
+    int numReaders = DEFAULT_READERS;
+    const char *indexName = NULL;
+    int stats = 0;
+    int bad = 0;
+    int arg = 1;
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0) {
+        if (strcmp(argv[arg], "--stats") == 0) {
+            stats = 1;
+            arg++;
+            continue;
+        }
+        if (arg + 1 >= argc)
+            bad = 1;
+        else if (strcmp(argv[arg], "--stream") == 0)
+            bad |= (window = atol(argv[arg + 1]) * 1024 * 1024) <= 0;
+        else if (strcmp(argv[arg], "--top") == 0)
+            bad |= (topK = atoi(argv[arg + 1])) <= 0;
+        else if (strcmp(argv[arg], "--approx") == 0)
+            bad |= (approx = atoi(argv[arg + 1])) <= 0;
+        else if (strcmp(argv[arg], "--readers") == 0)
+            bad |= (numReaders = atoi(argv[arg + 1])) <= 0;
+        else if (strcmp(argv[arg], "--index") == 0)
+            indexName = argv[arg + 1];
+        else
+            bad = 1;
+        arg += 2;
+    }
+    if (argc - arg < 2 || bad) {
+        printf("Usage: %s [--stream <window_mb>] [--top <k>] [--approx <counters>] "
+               "[--readers <n>] [--index <file>] [--stats] <file | directory | @list> "
+               "<num_threads>\n", argv[0]);
+        return 1;
+    }
+    const char *filename = argv[arg];
+    int numThreads = atoi(argv[arg + 1]);
+    if (numThreads <= 0) {
+        fprintf(stderr, "num_threads must be a positive integer\n");
         return 1;
     }
-    int numThreads = atoi(argv[2]);
-    FILE *f = fopen(argv[1], "r");
-    if (!f) {
-        perror("fopen");
+    // A directory or an @list of files is counted as one corpus
+    char **paths = NULL;
+    int numPaths = 0;
+    int fd = -1;
+    struct stat st;
+    if (filename[0] == '@') {
+        if (!(paths = readList(filename + 1, &numPaths)))
+            return 1;
+    } else if (stat(filename, &st) == 0 && S_ISDIR(st.st_mode)) {
+        if (!(paths = listDirectory(filename, &numPaths)))
+            return 1;
+    } else if ((fd = open(filename, O_RDONLY)) < 0) {
+        perror("open");
         return 1;
     }
-    fseek(f, 0, SEEK_END);
-    long size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    buffer = malloc(size + 1);
-    if (fread(buffer, 1, size, f) != size) {
-        perror("fread");
+    if (indexName && (paths || approx)) {
+        fprintf(stderr, "--index needs a single input file and exact counts\n");
         return 1;
     }
-    buffer[size] = '\0';
-    fclose(f);
 
     pthread_t *threads = malloc(numThreads * sizeof(pthread_t));
-    ThreadArg *args = malloc(numThreads * sizeof(ThreadArg));
-    long seg = size / numThreads;
+    // One table past the workers' holds the counts loaded from --index
+    ThreadArg *args = malloc((numThreads + 1) * sizeof(ThreadArg));
+    StringArena *arenas = calloc(numThreads + 1, sizeof(StringArena));
+    selectKernel();
+    initTable(&args[numThreads].table, INITIAL_TABLE_SIZE, arenas, numThreads);
+    long start = 0;
+    if (indexName) {
+        IndexView view;
+        if (openIndex(indexName, fd, &view)) {
+            start = loadIndex(&view, fd, &args[numThreads].table);
+            munmap(view.map, view.size);
+        }
+    }
     for (int i = 0; i < numThreads; i++) {
-        args[i].start = i * seg;
-        args[i].end = (i == numThreads - 1) ? size : (i + 1) * seg;
-        pthread_create(&threads[i], NULL, worker, &args[i]);
+        initTable(&args[i].table, INITIAL_TABLE_SIZE, arenas, i);
+        pthread_mutex_init(&args[i].deque.lock, NULL);
+        args[i].steals = 0;
+        args[i].lockWait = 0;
+        args[i].sketch = NULL;
+        args[i].pipeline = NULL;
+        if (approx) {
+            args[i].sketch = malloc(sizeof(SpaceSaving));
+            if (!args[i].sketch) {
+                perror("malloc");
+                return 1;
+            }
+            initSketch(args[i].sketch, approx);
+        }
+        args[i].scratch.lower = NULL;
+        args[i].scratch.spaces = NULL;
+        growScratch(&args[i].scratch, TILE_SIZE);
     }
-    for (int i = 0; i < numThreads; i++)
+
+    long end = 0;
+    long lockWait = 0;
+    if (paths) {
+        lockWait = countFiles(paths, numPaths, window > 0 ? window : SEGMENT_SIZE, numReaders,
+                   args, threads, numThreads);
+        for (int i = 0; i < numPaths; i++)
+            free(paths[i]);
+        free(paths);
+    } else if (window > 0) {
+        if (lseek(fd, start, SEEK_SET) < 0 ||
+            (end = countStream(fd, start, window, args, threads, numThreads)) < 0)
+            return 1;
+    } else {
+        if (fstat(fd, &st) < 0) {
+            perror("fstat");
+            return 1;
+        }
+        end = st.st_size;
+        // Only the part not already in the index is mapped
+        long skip = start & ~(sysconf(_SC_PAGESIZE) - 1);
+        if (end > start) {
+            char *map = mmap(NULL, end - skip, PROT_READ, MAP_PRIVATE, fd, skip);
+            if (map == MAP_FAILED) {
+                perror("mmap");
+                return 1;
+            }
+            madvise(map, end - skip, MADV_SEQUENTIAL);
+            countBuffer(map + (start - skip), end - start, start, args, threads, numThreads);
+            munmap(map, end - skip);
+        }
+    }
+    if (stats) {
+        // One line on stderr, for the benchmark harness
+        long steals = 0;
+        for (int i = 0; i < numThreads; i++) {
+            steals += args[i].steals;
+            lockWait += args[i].lockWait;
+        }
+        fprintf(stderr, "stats: steals=%ld lock_wait_ns=%ld\n", steals, lockWait);
+    }
+
+    if (approx) {
+        // Approximate counts, highest first, with how far each may be over
+        if (fd >= 0)
+            close(fd);
+        Counter *merged;
+        long n = mergeSketches(args, numThreads, &merged);
+        long shown = topK > 0 && topK < approx ? topK : approx;
+        long total = 0, bound = 0;
+        for (int i = 0; i < numThreads; i++) {
+            total += args[i].sketch->total;
+            bound += sketchMin(args[i].sketch);
+        }
+        for (long i = 0; i < n && i < shown; i++)
+            printf("%.*s: %ld (error <= %ld)\n", merged[i].len, merged[i].key,
+                   merged[i].count, merged[i].error);
+        printf("Total Words: %ld\n", total);
+        printf("Error Bound: %ld\n", bound);
+        free(merged);
+        for (int i = 0; i < numThreads; i++) {
+            freeSketch(args[i].sketch);
+            free(args[i].sketch);
+            free(args[i].table.slots);
+            free(args[i].scratch.lower);
+            free(args[i].scratch.spaces);
+            pthread_mutex_destroy(&args[i].deque.lock);
+        }
+        free(args[numThreads].table.slots);
+        free(arenas);
+        free(threads);
+        free(args);
+        return 0;
+    }
+
+    // Merge the per-thread tables in parallel, one hash partition per thread
+    MergeArg *merges = malloc(numThreads * sizeof(MergeArg));
+    for (int i = 0; i < numThreads; i++) {
+        merges[i].sources = args;
+        merges[i].numSources = numThreads + 1;
+        merges[i].partition = i;
+        merges[i].numPartitions = numThreads;
+        merges[i].topK = topK;
+        merges[i].top = NULL;
+        merges[i].numTop = 0;
+        pthread_create(&threads[i], NULL, merger, &merges[i]);
+    }
+    long distinct = 0;
+    for (int i = 0; i < numThreads; i++) {
         pthread_join(threads[i], NULL);
+        distinct += merges[i].table.size;
+    }
+    if (indexName && writeIndex(indexName, fd, end, merges, numThreads) < 0)
+        return 1;
+    if (fd >= 0)
+        close(fd);
 
-    int total = 0;
-    for (int i = 0; i < globalWordCount; i++) {
-        printf("%s: %d\n", globalWords[i], globalCounts[i]);
-        total += globalCounts[i];
-        free(globalWords[i]);
+    if (topK > 0) {
+        // Each partition's list is already sorted: merge their heads
+        long total = 0;
+        long *next = calloc(numThreads, sizeof(long));
+        for (int i = 0; i < numThreads; i++)
+            for (long j = 0; j < merges[i].table.capacity; j++)
+                total += merges[i].table.slots[j].count;
+        for (int k = 0; k < topK; k++) {
+            int best = -1;
+            for (int i = 0; i < numThreads; i++)
+                if (next[i] < merges[i].numTop &&
+                    (best < 0 || outranks(merges[i].top[next[i]], merges[best].top[next[best]])))
+                    best = i;
+            if (best < 0)
+                break;
+            WordEntry *e = merges[best].top[next[best]++];
+            printf("%.*s: %ld\n", e->len, entryWord(&merges[0].table, e), e->count);
+        }
+        printf("Total Words: %ld\n", total);
+        free(next);
+    } else {
+        // Report words in the order they first appear in the file
+        WordEntry **entries = malloc((distinct + 1) * sizeof(WordEntry *));
+        long n = 0;
+        for (int i = 0; i < numThreads; i++)
+            for (long j = 0; j < merges[i].table.capacity; j++)
+                if (merges[i].table.slots[j].len != 0)
+                    entries[n++] = &merges[i].table.slots[j];
+        qsort(entries, n, sizeof(WordEntry *), compareFirst);
+
+        long total = 0;
+        for (long i = 0; i < n; i++) {
+            printf("%.*s: %ld\n", entries[i]->len, entryWord(&merges[0].table, entries[i]),
+                   entries[i]->count);
+            total += entries[i]->count;
+        }
+        printf("Total Words: %ld\n", total);
+        free(entries);
     }
-    printf("Total Words: %d\n", total);
 
-    free(buffer);
+    for (int i = 0; i < numThreads; i++) {
+        free(arenas[i].bytes);
+        free(args[i].table.slots);
+        free(args[i].scratch.lower);
+        free(args[i].scratch.spaces);
+        pthread_mutex_destroy(&args[i].deque.lock);
+        free(merges[i].table.slots);
+        free(merges[i].top);
+    }
+    free(arenas[numThreads].bytes);
+    free(args[numThreads].table.slots);
+    free(merges);
+    free(arenas);
     free(threads);
     free(args);
     return 0;
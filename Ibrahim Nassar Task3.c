@@ -1,163 +1,1904 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-// Structure to represent each memory frame
+#define AGE_BITS 8          // width of the aging counter
+#define RECENT_SIZE 16      // holds the AGE_BITS + 1 newest touches
+#define MAP_INITIAL_SIZE 1024
+
+// Open-addressing hash map from page number to a value (frame index)
 typedef struct {
-    int page_number;       // Page number stored in the frame
-    unsigned int age;      // Used to approximate "least recently used" using 8 bits
-    int referenced;        // Flag to indicate if the page was referenced recently
-} PageFrame;
+    int *keys;
+    int *values;        // -1 marks an empty slot
+    int mask;
+    int size;
+} PageMap;
 
-// Counts how many unique page numbers are in the reference list
-int count_unique_pages(int *references, int num_references) {
-    int *unique = NULL;
-    int num_unique = 0;
+void page_map_init(PageMap *map, int min_capacity) {
+    int capacity = MAP_INITIAL_SIZE;
+    while (capacity < min_capacity * 2)
+        capacity *= 2;
+    map->keys = malloc(capacity * sizeof(int));
+    map->values = malloc(capacity * sizeof(int));
+    if (!map->keys || !map->values) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memset(map->values, -1, capacity * sizeof(int));
+    map->mask = capacity - 1;
+    map->size = 0;
+}
 
-    for (int i = 0; i < num_references; i++) {
-        int found = 0;
-        // Check if this page is already counted
-        for (int j = 0; j < num_unique; j++) {
-            if (unique && unique[j] == references[i]) {
-                found = 1;
-                break;
-            }
-        }
-        if (!found) {
-            // Add the unique page to our list
-            unique = realloc(unique, (num_unique + 1) * sizeof(int));
-            if (!unique) {
-                perror("realloc");
-                exit(EXIT_FAILURE);
-            }
-            unique[num_unique++] = references[i];
+void page_map_free(PageMap *map) {
+    free(map->keys);
+    free(map->values);
+}
+
+int page_map_home(PageMap *map, int page) {
+    return (int)(((unsigned int)page * 0x9E3779B1U) >> 7) & map->mask;
+}
+
+// Slot holding page, or the empty slot where it would go
+int page_map_slot(PageMap *map, int page) {
+    int i = page_map_home(map, page);
+    while (map->values[i] >= 0 && map->keys[i] != page)
+        i = (i + 1) & map->mask;
+    return i;
+}
+
+void page_map_grow(PageMap *map) {
+    PageMap bigger;
+    page_map_init(&bigger, map->mask + 1);
+    for (int i = 0; i <= map->mask; i++) {
+        if (map->values[i] >= 0) {
+            int j = page_map_slot(&bigger, map->keys[i]);
+            bigger.keys[j] = map->keys[i];
+            bigger.values[j] = map->values[i];
+            bigger.size++;
         }
     }
+    page_map_free(map);
+    *map = bigger;
+}
+
+void page_map_put(PageMap *map, int page, int value) {
+    if ((map->size + 1) * 2 > map->mask + 1)
+        page_map_grow(map);
+    int i = page_map_slot(map, page);
+    if (map->values[i] < 0)
+        map->size++;
+    map->keys[i] = page;
+    map->values[i] = value;
+}
+
+// Empties a slot, moving later entries of its probe run back into the gap
+void page_map_remove(PageMap *map, int slot) {
+    int i = slot, j = slot;
+    while (1) {
+        j = (j + 1) & map->mask;
+        if (map->values[j] < 0)
+            break;
+        int home = page_map_home(map, map->keys[j]);
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+        map->keys[i] = map->keys[j];
+        map->values[i] = map->values[j];
+        i = j;
+    }
+    map->values[i] = -1;
+    map->size--;
+}
 
-    free(unique);
+// Counts how many unique page numbers are in the reference list
+int count_unique_pages(int *references, int num_references) {
+    PageMap seen;
+    page_map_init(&seen, 0);
+    for (int i = 0; i < num_references; i++)
+        page_map_put(&seen, references[i], 1);
+    int num_unique = seen.size;
+    page_map_free(&seen);
     return num_unique;
 }
 
-// Runs the aging page replacement algorithm for a given number of frames
-int simulate_aging(int *references, int num_references, int num_frames) {
-    PageFrame *frames = calloc(num_frames, sizeof(PageFrame)); // Allocate space for frames
-    if (!frames) {
+/*
+ * Replacement policies share one driver. The FrameStore owns which page
+ * sits in which frame and the page -> frame map; frames are filled in
+ * order until all are used, and only then is the policy asked for a
+ * victim. A policy only tracks frame indices (plus any history of pages
+ * it has evicted) through the calls below. now is the reference's index
+ * in the trace and only increases.
+ */
+typedef struct {
+    int num_frames;
+    int used;               // frames filled so far
+    int *page_number;
+    PageMap map;            // page number -> frame
+} FrameStore;
+
+typedef struct {
+    const char *name;
+    void *(*create)(int num_frames, int *references, int num_references);
+    void (*hit)(void *state, int frame, long now);
+    int (*victim)(void *state, int page, long now);     // all frames are in use
+    void (*load)(void *state, int frame, int page, long now);
+    void (*destroy)(void *state);
+} Policy;
+
+void frame_store_init(FrameStore *store, int num_frames) {
+    store->num_frames = num_frames;
+    store->used = 0;
+    store->page_number = malloc(num_frames * sizeof(int));
+    if (!store->page_number) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    page_map_init(&store->map, num_frames);
+}
+
+void frame_store_free(FrameStore *store) {
+    free(store->page_number);
+    page_map_free(&store->map);
+}
+
+// Runs one reference through a policy; returns 1 on a page fault
+int policy_access(const Policy *policy, void *state, FrameStore *store, int page, long now) {
+    int frame = store->map.values[page_map_slot(&store->map, page)];
+    if (frame >= 0) {
+        policy->hit(state, frame, now);
+        return 0;
+    }
+    if (store->used < store->num_frames) {
+        frame = store->used++;
+    } else {
+        frame = policy->victim(state, page, now);
+        page_map_remove(&store->map, page_map_slot(&store->map, store->page_number[frame]));
+    }
+    store->page_number[frame] = page;
+    page_map_put(&store->map, page, frame);
+    policy->load(state, frame, page, now);
+    return 1;
+}
+
+void *alloc_zeroed(size_t size) {
+    void *p = calloc(1, size ? size : 1);
+    if (!p) {
         perror("calloc");
         exit(EXIT_FAILURE);
     }
+    return p;
+}
+
+/*
+ * Aging replacement without scanning the frames. Every frame's 8-bit age
+ * holds one bit for each of the last 8 references that touched it (a hit
+ * or a load), the newest in the top bit. So:
+ *  - a frame not touched in the last 8 references has age 0, and among
+ *    those the victim is the lowest frame index;
+ *  - otherwise every frame was touched in the last 8 references, and the
+ *    smallest age is the least recently touched frame.
+ * Frames idle for 8+ references sit in a min-heap on frame index, and a
+ * small queue remembers the touches of the last 8 references. A hit is
+ * O(1), a miss O(log F). Faults match the original scan exactly.
+ */
+typedef struct {
+    long *last_touch;       // reference that last hit or loaded the frame
+    char *in_heap;
+    int *heap;              // idle frames; entries touched since are dropped lazily
+    int heap_size;
+    int recent_frame[RECENT_SIZE];  // touches of the last AGE_BITS references,
+    long recent_time[RECENT_SIZE];  // oldest at recent_head
+    int recent_head;
+    int recent_count;
+} AgingSim;
+
+void *aging_create(int num_frames, int *references, int num_references) {
+    (void)references;
+    (void)num_references;
+    AgingSim *sim = alloc_zeroed(sizeof(AgingSim));
+    sim->last_touch = alloc_zeroed(num_frames * sizeof(long));
+    sim->in_heap = alloc_zeroed(num_frames);
+    sim->heap = alloc_zeroed(num_frames * sizeof(int));
+    return sim;
+}
+
+void aging_destroy(void *state) {
+    AgingSim *sim = state;
+    free(sim->last_touch);
+    free(sim->in_heap);
+    free(sim->heap);
+    free(sim);
+}
+
+void heap_push(AgingSim *sim, int frame) {
+    int i = sim->heap_size++;
+    while (i > 0 && sim->heap[(i - 1) / 2] > frame) {
+        sim->heap[i] = sim->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    sim->heap[i] = frame;
+}
 
+int heap_pop(AgingSim *sim) {
+    int top = sim->heap[0];
+    int last = sim->heap[--sim->heap_size];
+    int i = 0;
+    while (2 * i + 1 < sim->heap_size) {
+        int child = 2 * i + 1;
+        if (child + 1 < sim->heap_size && sim->heap[child + 1] < sim->heap[child])
+            child++;
+        if (sim->heap[child] >= last)
+            break;
+        sim->heap[i] = sim->heap[child];
+        i = child;
+    }
+    sim->heap[i] = last;
+    return top;
+}
+
+// Frames whose last touch has left the window drop to age 0
+void aging_expire(AgingSim *sim, long now) {
+    while (sim->recent_count > 0 && sim->recent_time[sim->recent_head] < now - AGE_BITS) {
+        int idle = sim->recent_frame[sim->recent_head];
+        if (sim->last_touch[idle] == sim->recent_time[sim->recent_head] && !sim->in_heap[idle]) {
+            sim->in_heap[idle] = 1;
+            heap_push(sim, idle);
+        }
+        sim->recent_head = (sim->recent_head + 1) % RECENT_SIZE;
+        sim->recent_count--;
+    }
+}
+
+void aging_touch(void *state, int frame, long now) {
+    AgingSim *sim = state;
+    aging_expire(sim, now);
+    sim->last_touch[frame] = now;
+    int tail = (sim->recent_head + sim->recent_count++) % RECENT_SIZE;
+    sim->recent_frame[tail] = frame;
+    sim->recent_time[tail] = now;
+}
+
+void aging_load(void *state, int frame, int page, long now) {
+    (void)page;
+    aging_touch(state, frame, now);
+}
+
+// Frame the original scan would pick: the smallest age, lowest index first
+int aging_victim(void *state, int page, long now) {
+    (void)page;
+    AgingSim *sim = state;
+    aging_expire(sim, now);
+
+    // Drop heap entries touched again since they went idle
+    while (sim->heap_size > 0 && sim->last_touch[sim->heap[0]] >= now - AGE_BITS)
+        sim->in_heap[heap_pop(sim)] = 0;
+    if (sim->heap_size > 0) {
+        int frame = heap_pop(sim);
+        sim->in_heap[frame] = 0;
+        return frame;
+    }
+
+    // All frames are recent: the oldest last touch has the smallest age
+    for (int k = 0; k < sim->recent_count; k++) {
+        int i = (sim->recent_head + k) % RECENT_SIZE;
+        if (sim->last_touch[sim->recent_frame[i]] == sim->recent_time[i])
+            return sim->recent_frame[i];
+    }
+    return 0;
+}
+
+const Policy aging_policy = {"aging", aging_create, aging_touch, aging_victim, aging_load,
+                             aging_destroy};
+
+int simulate_policy(const Policy *policy, int *references, int num_references, int num_frames) {
+    FrameStore store;
+    frame_store_init(&store, num_frames);
+    void *state = policy->create(num_frames, references, num_references);
     int page_faults = 0;
+    for (int i = 0; i < num_references; i++)
+        page_faults += policy_access(policy, state, &store, references[i], i);
+    policy->destroy(state);
+    frame_store_free(&store);
+    return page_faults;
+}
+
+// Runs the aging page replacement algorithm for a given number of frames
+int simulate_aging(int *references, int num_references, int num_frames) {
+    return simulate_policy(&aging_policy, references, num_references, num_frames);
+}
+
+/*
+ * Intrusive doubly linked lists for the list-based policies. Nodes are
+ * frame indices, and ghost entries (pages recently evicted, kept only as
+ * history) take the node ids after the frames, so one prev/next pair of
+ * arrays serves every list of a policy. The head is the most recent end.
+ */
+typedef struct {
+    int *prev;
+    int *next;
+} Links;
+
+typedef struct {
+    int head;
+    int tail;
+    int size;
+} List;
+
+void links_init(Links *links, int num_nodes) {
+    links->prev = alloc_zeroed(num_nodes * sizeof(int));
+    links->next = alloc_zeroed(num_nodes * sizeof(int));
+}
+
+void links_free(Links *links) {
+    free(links->prev);
+    free(links->next);
+}
+
+void list_init(List *list) {
+    list->head = list->tail = -1;
+    list->size = 0;
+}
+
+void list_push(Links *links, List *list, int node) {
+    links->prev[node] = -1;
+    links->next[node] = list->head;
+    if (list->head >= 0)
+        links->prev[list->head] = node;
+    else
+        list->tail = node;
+    list->head = node;
+    list->size++;
+}
+
+void list_unlink(Links *links, List *list, int node) {
+    if (links->prev[node] >= 0)
+        links->next[links->prev[node]] = links->next[node];
+    else
+        list->head = links->next[node];
+    if (links->next[node] >= 0)
+        links->prev[links->next[node]] = links->prev[node];
+    else
+        list->tail = links->prev[node];
+    list->size--;
+}
+
+// Ghost entries: node ids base..base+capacity-1 and a page -> node map
+typedef struct {
+    int base;
+    int *page;
+    int *free_nodes;
+    int num_free;
+    PageMap map;
+} Ghosts;
+
+void ghosts_init(Ghosts *ghosts, int base, int capacity) {
+    ghosts->base = base;
+    ghosts->page = alloc_zeroed(capacity * sizeof(int));
+    ghosts->free_nodes = alloc_zeroed(capacity * sizeof(int));
+    for (int i = 0; i < capacity; i++)
+        ghosts->free_nodes[i] = base + capacity - 1 - i;
+    ghosts->num_free = capacity;
+    page_map_init(&ghosts->map, capacity);
+}
+
+void ghosts_free(Ghosts *ghosts) {
+    free(ghosts->page);
+    free(ghosts->free_nodes);
+    page_map_free(&ghosts->map);
+}
+
+int ghost_find(Ghosts *ghosts, int page) {
+    return ghosts->map.values[page_map_slot(&ghosts->map, page)];
+}
 
-    // Initialize all frames to be empty
-    for (int i = 0; i < num_frames; i++) {
-        frames[i].page_number = -1;
-        frames[i].age = 0;
-        frames[i].referenced = 0;
+void ghost_add(Ghosts *ghosts, Links *links, List *list, int page) {
+    int node = ghosts->free_nodes[--ghosts->num_free];
+    ghosts->page[node - ghosts->base] = page;
+    page_map_put(&ghosts->map, page, node);
+    list_push(links, list, node);
+}
+
+void ghost_drop(Ghosts *ghosts, Links *links, List *list, int node) {
+    list_unlink(links, list, node);
+    int page = ghosts->page[node - ghosts->base];
+    page_map_remove(&ghosts->map, page_map_slot(&ghosts->map, page));
+    ghosts->free_nodes[ghosts->num_free++] = node;
+}
+
+// LRU: a hit moves the frame to the head, the victim is the tail
+typedef struct {
+    Links links;
+    List list;
+} LruSim;
+
+void *lru_create(int num_frames, int *references, int num_references) {
+    (void)references;
+    (void)num_references;
+    LruSim *sim = alloc_zeroed(sizeof(LruSim));
+    links_init(&sim->links, num_frames);
+    list_init(&sim->list);
+    return sim;
+}
+
+void lru_hit(void *state, int frame, long now) {
+    (void)now;
+    LruSim *sim = state;
+    list_unlink(&sim->links, &sim->list, frame);
+    list_push(&sim->links, &sim->list, frame);
+}
+
+int lru_victim(void *state, int page, long now) {
+    (void)page;
+    (void)now;
+    LruSim *sim = state;
+    int frame = sim->list.tail;
+    list_unlink(&sim->links, &sim->list, frame);
+    return frame;
+}
+
+void lru_load(void *state, int frame, int page, long now) {
+    (void)page;
+    (void)now;
+    LruSim *sim = state;
+    list_push(&sim->links, &sim->list, frame);
+}
+
+void lru_destroy(void *state) {
+    LruSim *sim = state;
+    links_free(&sim->links);
+    free(sim);
+}
+
+const Policy lru_policy = {"lru", lru_create, lru_hit, lru_victim, lru_load, lru_destroy};
+
+/*
+ * Clock: a hand sweeps the frames, clearing reference bits, and takes
+ * the first frame whose bit is already clear. Each bit it clears was set
+ * by a reference, so a victim costs O(1) amortized.
+ */
+typedef struct {
+    int num_frames;
+    int hand;
+    char *referenced;
+} ClockSim;
+
+void *clock_create(int num_frames, int *references, int num_references) {
+    (void)references;
+    (void)num_references;
+    ClockSim *sim = alloc_zeroed(sizeof(ClockSim));
+    sim->num_frames = num_frames;
+    sim->referenced = alloc_zeroed(num_frames);
+    return sim;
+}
+
+void clock_hit(void *state, int frame, long now) {
+    (void)now;
+    ((ClockSim *)state)->referenced[frame] = 1;
+}
+
+int clock_victim(void *state, int page, long now) {
+    (void)page;
+    (void)now;
+    ClockSim *sim = state;
+    while (sim->referenced[sim->hand]) {
+        sim->referenced[sim->hand] = 0;
+        sim->hand = (sim->hand + 1) % sim->num_frames;
     }
+    int frame = sim->hand;
+    sim->hand = (sim->hand + 1) % sim->num_frames;
+    return frame;
+}
 
-    // Loop through all page references
-    for (int i = 0; i < num_references; i++) {
-        int current_page = references[i];
-        int found = 0;
+void clock_load(void *state, int frame, int page, long now) {
+    (void)page;
+    (void)now;
+    ((ClockSim *)state)->referenced[frame] = 1;
+}
+
+void clock_destroy(void *state) {
+    ClockSim *sim = state;
+    free(sim->referenced);
+    free(sim);
+}
+
+const Policy clock_policy = {"clock", clock_create, clock_hit, clock_victim, clock_load,
+                             clock_destroy};
+
+/*
+ * WSClock: Clock where a frame with a clear bit is only taken once it has
+ * left the working set, i.e. was last seen more than wsclock_tau
+ * references ago. A set bit is cleared and stamps the frame with the
+ * current time. If a whole turn finds nothing old enough, the least
+ * recently stamped frame seen on the way is taken, so a victim is O(F)
+ * in the worst case, O(1) when the working set fits.
+ */
+long wsclock_tau = 1000;
+
+typedef struct {
+    int num_frames;
+    int hand;
+    char *referenced;
+    long *last_use;
+} WsClockSim;
+
+void *wsclock_create(int num_frames, int *references, int num_references) {
+    (void)references;
+    (void)num_references;
+    WsClockSim *sim = alloc_zeroed(sizeof(WsClockSim));
+    sim->num_frames = num_frames;
+    sim->referenced = alloc_zeroed(num_frames);
+    sim->last_use = alloc_zeroed(num_frames * sizeof(long));
+    return sim;
+}
+
+void wsclock_hit(void *state, int frame, long now) {
+    (void)now;
+    ((WsClockSim *)state)->referenced[frame] = 1;
+}
+
+int wsclock_victim(void *state, int page, long now) {
+    (void)page;
+    WsClockSim *sim = state;
+    int oldest = -1;
+    for (int k = 0; k < sim->num_frames; k++) {
+        int frame = sim->hand;
+        sim->hand = (sim->hand + 1) % sim->num_frames;
+        if (sim->referenced[frame]) {
+            sim->referenced[frame] = 0;
+            sim->last_use[frame] = now;
+            continue;
+        }
+        if (now - sim->last_use[frame] > wsclock_tau)
+            return frame;
+        if (oldest < 0 || sim->last_use[frame] < sim->last_use[oldest])
+            oldest = frame;
+    }
+    if (oldest >= 0)
+        return oldest;
+    // Every bit was set: the turn cleared them all, take the frame under the hand
+    int frame = sim->hand;
+    sim->hand = (sim->hand + 1) % sim->num_frames;
+    return frame;
+}
+
+void wsclock_load(void *state, int frame, int page, long now) {
+    (void)page;
+    WsClockSim *sim = state;
+    sim->referenced[frame] = 1;
+    sim->last_use[frame] = now;
+}
+
+void wsclock_destroy(void *state) {
+    WsClockSim *sim = state;
+    free(sim->referenced);
+    free(sim->last_use);
+    free(sim);
+}
+
+const Policy wsclock_policy = {"wsclock", wsclock_create, wsclock_hit, wsclock_victim,
+                               wsclock_load, wsclock_destroy};
+
+/*
+ * 2Q (Johnson and Shasha, full version): a first reference lands in the
+ * FIFO A1in, and only a page referenced again after falling out of A1in
+ * (it is still remembered in the ghost FIFO A1out) is admitted to the LRU
+ * Am. A1in holds a quarter of the frames, A1out remembers half as many
+ * pages as there are frames. Every step is O(1).
+ */
+typedef struct {
+    Links links;
+    List a1in;
+    List am;
+    List a1out;
+    Ghosts ghosts;
+    int *page_of;       // page in each frame, for remembering it in A1out
+    char *in_am;
+    int kin;
+    int kout;
+    int to_am;          // the page being loaded was found in A1out
+} TwoQSim;
+
+void *twoq_create(int num_frames, int *references, int num_references) {
+    (void)references;
+    (void)num_references;
+    TwoQSim *sim = alloc_zeroed(sizeof(TwoQSim));
+    sim->kin = num_frames / 4 > 1 ? num_frames / 4 : 1;
+    sim->kout = num_frames / 2 > 1 ? num_frames / 2 : 1;
+    links_init(&sim->links, num_frames + sim->kout + 1);
+    list_init(&sim->a1in);
+    list_init(&sim->am);
+    list_init(&sim->a1out);
+    ghosts_init(&sim->ghosts, num_frames, sim->kout + 1);
+    sim->page_of = alloc_zeroed(num_frames * sizeof(int));
+    sim->in_am = alloc_zeroed(num_frames);
+    return sim;
+}
+
+void twoq_hit(void *state, int frame, long now) {
+    (void)now;
+    TwoQSim *sim = state;
+    if (sim->in_am[frame]) {
+        list_unlink(&sim->links, &sim->am, frame);
+        list_push(&sim->links, &sim->am, frame);
+    }
+}
+
+int twoq_victim(void *state, int page, long now) {
+    (void)now;
+    TwoQSim *sim = state;
+    int ghost = ghost_find(&sim->ghosts, page);
+    sim->to_am = ghost >= 0;
+    if (ghost >= 0)
+        ghost_drop(&sim->ghosts, &sim->links, &sim->a1out, ghost);
+
+    int frame;
+    if (sim->a1in.size > sim->kin || sim->am.size == 0) {
+        frame = sim->a1in.tail;
+        list_unlink(&sim->links, &sim->a1in, frame);
+        if (sim->a1out.size == sim->kout)
+            ghost_drop(&sim->ghosts, &sim->links, &sim->a1out, sim->a1out.tail);
+        ghost_add(&sim->ghosts, &sim->links, &sim->a1out, sim->page_of[frame]);
+        return frame;
+    }
+    frame = sim->am.tail;
+    list_unlink(&sim->links, &sim->am, frame);
+    sim->in_am[frame] = 0;
+    return frame;
+}
+
+void twoq_load(void *state, int frame, int page, long now) {
+    (void)now;
+    TwoQSim *sim = state;
+    sim->page_of[frame] = page;
+    sim->in_am[frame] = sim->to_am;
+    list_push(&sim->links, sim->to_am ? &sim->am : &sim->a1in, frame);
+    sim->to_am = 0;
+}
+
+void twoq_destroy(void *state) {
+    TwoQSim *sim = state;
+    links_free(&sim->links);
+    ghosts_free(&sim->ghosts);
+    free(sim->page_of);
+    free(sim->in_am);
+    free(sim);
+}
+
+const Policy twoq_policy = {"2q", twoq_create, twoq_hit, twoq_victim, twoq_load,
+                            twoq_destroy};
+
+/*
+ * ARC (Megiddo and Modha): T1 holds pages seen once recently, T2 pages
+ * seen at least twice, and the ghost lists B1 and B2 remember pages
+ * evicted from each. A miss that hits a ghost moves the target size p of
+ * T1 towards the list it came from. Ghosts exist only once all frames are
+ * in use, so the cold start just fills T1. Every step is O(1).
+ */
+typedef struct {
+    int num_frames;
+    int target;         // p, the size T1 is steered towards
+    Links links;
+    List t1;
+    List t2;
+    List b1;
+    List b2;
+    Ghosts ghosts;
+    int *page_of;
+    char *in_t2;        // per frame
+    char *in_b2;        // per ghost node
+    int to_t2;          // the page being loaded was found in B1 or B2
+} ArcSim;
+
+void *arc_create(int num_frames, int *references, int num_references) {
+    (void)references;
+    (void)num_references;
+    ArcSim *sim = alloc_zeroed(sizeof(ArcSim));
+    sim->num_frames = num_frames;
+    links_init(&sim->links, 2 * num_frames + 1);
+    list_init(&sim->t1);
+    list_init(&sim->t2);
+    list_init(&sim->b1);
+    list_init(&sim->b2);
+    ghosts_init(&sim->ghosts, num_frames, num_frames + 1);
+    sim->page_of = alloc_zeroed(num_frames * sizeof(int));
+    sim->in_t2 = alloc_zeroed(num_frames);
+    sim->in_b2 = alloc_zeroed(num_frames + 1);
+    return sim;
+}
+
+void arc_hit(void *state, int frame, long now) {
+    (void)now;
+    ArcSim *sim = state;
+    list_unlink(&sim->links, sim->in_t2[frame] ? &sim->t2 : &sim->t1, frame);
+    list_push(&sim->links, &sim->t2, frame);
+    sim->in_t2[frame] = 1;
+}
+
+void arc_forget(ArcSim *sim, List *list) {
+    ghost_drop(&sim->ghosts, &sim->links, list, list->tail);
+}
+
+// REPLACE: evict the LRU end of T1 or T2 into its ghost list
+int arc_replace(ArcSim *sim, int from_b2) {
+    int frame;
+    if (sim->t1.size > 0 && (sim->t2.size == 0 || sim->t1.size > sim->target ||
+                             (from_b2 && sim->t1.size == sim->target))) {
+        frame = sim->t1.tail;
+        list_unlink(&sim->links, &sim->t1, frame);
+        ghost_add(&sim->ghosts, &sim->links, &sim->b1, sim->page_of[frame]);
+        sim->in_b2[sim->b1.head - sim->ghosts.base] = 0;
+    } else {
+        frame = sim->t2.tail;
+        list_unlink(&sim->links, &sim->t2, frame);
+        ghost_add(&sim->ghosts, &sim->links, &sim->b2, sim->page_of[frame]);
+        sim->in_b2[sim->b2.head - sim->ghosts.base] = 1;
+    }
+    return frame;
+}
+
+int arc_victim(void *state, int page, long now) {
+    (void)now;
+    ArcSim *sim = state;
+    int c = sim->num_frames;
+    int ghost = ghost_find(&sim->ghosts, page);
+    if (ghost >= 0) {
+        int from_b2 = sim->in_b2[ghost - sim->ghosts.base];
+        if (from_b2) {
+            int delta = sim->b1.size > sim->b2.size ? sim->b1.size / sim->b2.size : 1;
+            sim->target = sim->target > delta ? sim->target - delta : 0;
+            ghost_drop(&sim->ghosts, &sim->links, &sim->b2, ghost);
+        } else {
+            int delta = sim->b2.size > sim->b1.size ? sim->b2.size / sim->b1.size : 1;
+            sim->target = sim->target + delta < c ? sim->target + delta : c;
+            ghost_drop(&sim->ghosts, &sim->links, &sim->b1, ghost);
+        }
+        sim->to_t2 = 1;
+        return arc_replace(sim, from_b2);
+    }
+
+    if (sim->t1.size + sim->b1.size == c) {
+        if (sim->t1.size == c) {
+            // T1 fills the cache: drop its LRU page without remembering it
+            int frame = sim->t1.tail;
+            list_unlink(&sim->links, &sim->t1, frame);
+            return frame;
+        }
+        arc_forget(sim, &sim->b1);
+    } else if (sim->t1.size + sim->t2.size + sim->b1.size + sim->b2.size == 2 * c) {
+        arc_forget(sim, &sim->b2);
+    }
+    return arc_replace(sim, 0);
+}
+
+void arc_load(void *state, int frame, int page, long now) {
+    (void)now;
+    ArcSim *sim = state;
+    sim->page_of[frame] = page;
+    sim->in_t2[frame] = sim->to_t2;
+    list_push(&sim->links, sim->to_t2 ? &sim->t2 : &sim->t1, frame);
+    sim->to_t2 = 0;
+}
+
+void arc_destroy(void *state) {
+    ArcSim *sim = state;
+    links_free(&sim->links);
+    ghosts_free(&sim->ghosts);
+    free(sim->page_of);
+    free(sim->in_t2);
+    free(sim->in_b2);
+    free(sim);
+}
+
+const Policy arc_policy = {"arc", arc_create, arc_hit, arc_victim, arc_load, arc_destroy};
+
+/*
+ * Belady's OPT: evict the frame whose page is next used furthest in the
+ * future. The next use of every reference is found in one backward pass
+ * at create, and the frames sit in a max-heap keyed on it, updated on
+ * every hit and load, so a step is O(log F).
+ */
+typedef struct {
+    int *next_use;      // per reference; num_references when never again
+    int *key;           // per frame, the next use of its page
+    int *heap;
+    int *position;      // per frame, its index in heap
+    int heap_size;
+} OptSim;
+
+void *opt_create(int num_frames, int *references, int num_references) {
+    OptSim *sim = alloc_zeroed(sizeof(OptSim));
+    sim->next_use = alloc_zeroed(num_references * sizeof(int));
+    sim->key = alloc_zeroed(num_frames * sizeof(int));
+    sim->heap = alloc_zeroed(num_frames * sizeof(int));
+    sim->position = alloc_zeroed(num_frames * sizeof(int));
+
+    PageMap seen;
+    page_map_init(&seen, MAP_INITIAL_SIZE);
+    for (int i = num_references - 1; i >= 0; i--) {
+        int slot = page_map_slot(&seen, references[i]);
+        sim->next_use[i] = seen.values[slot] >= 0 ? seen.values[slot] : num_references;
+        page_map_put(&seen, references[i], i);
+    }
+    page_map_free(&seen);
+    return sim;
+}
+
+void opt_swap(OptSim *sim, int i, int j) {
+    int t = sim->heap[i];
+    sim->heap[i] = sim->heap[j];
+    sim->heap[j] = t;
+    sim->position[sim->heap[i]] = i;
+    sim->position[sim->heap[j]] = j;
+}
+
+void opt_update(OptSim *sim, int frame, int key) {
+    sim->key[frame] = key;
+    int i = sim->position[frame];
+    while (i > 0 && sim->key[sim->heap[(i - 1) / 2]] < key) {
+        opt_swap(sim, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while (2 * i + 1 < sim->heap_size) {
+        int child = 2 * i + 1;
+        if (child + 1 < sim->heap_size &&
+            sim->key[sim->heap[child + 1]] > sim->key[sim->heap[child]])
+            child++;
+        if (sim->key[sim->heap[child]] <= key)
+            break;
+        opt_swap(sim, i, child);
+        i = child;
+    }
+}
+
+void opt_hit(void *state, int frame, long now) {
+    OptSim *sim = state;
+    opt_update(sim, frame, sim->next_use[now]);
+}
 
-        // Check if the page is already in memory
-        for (int j = 0; j < num_frames; j++) {
-            if (frames[j].page_number == current_page) {
-                found = 1;
-                frames[j].referenced = 1; // Mark as recently used
-                break;
+int opt_victim(void *state, int page, long now) {
+    (void)page;
+    (void)now;
+    return ((OptSim *)state)->heap[0];
+}
+
+// The victim keeps its heap entry; its key becomes the new page's next use
+void opt_load(void *state, int frame, int page, long now) {
+    (void)page;
+    OptSim *sim = state;
+    if (sim->heap_size < frame + 1) {
+        sim->heap[sim->heap_size] = frame;
+        sim->position[frame] = sim->heap_size++;
+        sim->key[frame] = -1;
+    }
+    opt_update(sim, frame, sim->next_use[now]);
+}
+
+void opt_destroy(void *state) {
+    OptSim *sim = state;
+    free(sim->next_use);
+    free(sim->key);
+    free(sim->heap);
+    free(sim->position);
+    free(sim);
+}
+
+const Policy opt_policy = {"opt", opt_create, opt_hit, opt_victim, opt_load, opt_destroy};
+
+const Policy *policies[] = {
+    &aging_policy, &lru_policy, &opt_policy, &clock_policy, &wsclock_policy, &twoq_policy,
+    &arc_policy,
+};
+
+#define MAX_POLICIES 8
+
+// Runs several policies over one pass of the trace, each with its own frames
+void simulate_policies(const Policy **run, int num_run, int *references, int num_references,
+                       int num_frames, long *page_faults) {
+    FrameStore stores[MAX_POLICIES];
+    void *states[MAX_POLICIES];
+    for (int k = 0; k < num_run; k++) {
+        frame_store_init(&stores[k], num_frames);
+        states[k] = run[k]->create(num_frames, references, num_references);
+        page_faults[k] = 0;
+    }
+    for (int i = 0; i < num_references; i++)
+        for (int k = 0; k < num_run; k++)
+            page_faults[k] += policy_access(run[k], states[k], &stores[k], references[i], i);
+    for (int k = 0; k < num_run; k++) {
+        run[k]->destroy(states[k]);
+        frame_store_free(&stores[k]);
+    }
+}
+
+/*
+ * Eager engine: the original per-reference update over a structure of
+ * arrays. Ages are one byte per frame (padded to a multiple of 32) and
+ * the referenced flags are packed 64 to a word, so the shift-and-OR and
+ * the minimum search run on whole vectors.
+ */
+typedef struct {
+    int num_frames;
+    int used;
+    int *page_number;
+    unsigned char *age;
+    uint64_t *referenced;
+    PageMap map;
+} EagerSim;
+
+// age = (age >> 1) | referenced << 7 for n frames, then clear referenced
+typedef void (*ShiftFn)(unsigned char *age, uint64_t *referenced, int n);
+// Lowest frame index with the smallest age
+typedef int (*MinAgeFn)(const unsigned char *age, int n);
+
+// Sets the top bit of every referenced frame and clears the flags
+void or_referenced(unsigned char *age, uint64_t *referenced, int n) {
+    for (int w = 0; w < (n + 63) / 64; w++) {
+        uint64_t bits = referenced[w];
+        while (bits) {
+            age[w * 64 + __builtin_ctzll(bits)] |= 0x80;
+            bits &= bits - 1;
+        }
+        referenced[w] = 0;
+    }
+}
+
+void shift_ages_scalar(unsigned char *age, uint64_t *referenced, int n) {
+    for (int j = 0; j < n; j++)
+        age[j] >>= 1;
+    or_referenced(age, referenced, n);
+}
+
+int min_age_scalar(const unsigned char *age, int n) {
+    int best = 0;
+    for (int j = 1; j < n && age[best] != 0; j++)
+        if (age[j] < age[best])
+            best = j;
+    return best;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+void shift_ages_sse2(unsigned char *age, uint64_t *referenced, int n) {
+    const __m128i low7 = _mm_set1_epi8(0x7F);
+    for (int j = 0; j < n; j += 16) {
+        __m128i v = _mm_loadu_si128((__m128i *)(age + j));
+        _mm_storeu_si128((__m128i *)(age + j), _mm_and_si128(_mm_srli_epi16(v, 1), low7));
+    }
+    or_referenced(age, referenced, n);
+}
+
+int min_age_sse2(const unsigned char *age, int n) {
+    int full = n & ~15;
+    __m128i low = _mm_set1_epi8(-1);
+    for (int j = 0; j < full; j += 16)
+        low = _mm_min_epu8(low, _mm_loadu_si128((const __m128i *)(age + j)));
+    unsigned char lanes[16];
+    _mm_storeu_si128((__m128i *)lanes, low);
+    unsigned char best = 0xFF;
+    for (int k = 0; k < 16; k++)
+        if (lanes[k] < best)
+            best = lanes[k];
+    for (int j = full; j < n; j++)
+        if (age[j] < best)
+            best = age[j];
+    __m128i want = _mm_set1_epi8((char)best);
+    for (int j = 0; j < full; j += 16) {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(age + j)), want));
+        if (mask)
+            return j + __builtin_ctz(mask);
+    }
+    for (int j = full; j < n; j++)
+        if (age[j] == best)
+            return j;
+    return 0;
+}
+
+__attribute__((target("avx2")))
+void shift_ages_avx2(unsigned char *age, uint64_t *referenced, int n) {
+    const __m256i low7 = _mm256_set1_epi8(0x7F);
+    for (int j = 0; j < n; j += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i *)(age + j));
+        _mm256_storeu_si256((__m256i *)(age + j), _mm256_and_si256(_mm256_srli_epi16(v, 1), low7));
+    }
+    or_referenced(age, referenced, n);
+}
+
+__attribute__((target("avx2")))
+int min_age_avx2(const unsigned char *age, int n) {
+    int full = n & ~31;
+    __m256i low = _mm256_set1_epi8(-1);
+    for (int j = 0; j < full; j += 32)
+        low = _mm256_min_epu8(low, _mm256_loadu_si256((const __m256i *)(age + j)));
+    unsigned char lanes[32];
+    _mm256_storeu_si256((__m256i *)lanes, low);
+    unsigned char best = 0xFF;
+    for (int k = 0; k < 32; k++)
+        if (lanes[k] < best)
+            best = lanes[k];
+    for (int j = full; j < n; j++)
+        if (age[j] < best)
+            best = age[j];
+    __m256i want = _mm256_set1_epi8((char)best);
+    for (int j = 0; j < full; j += 32) {
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(age + j)), want));
+        if (mask)
+            return j + __builtin_ctz(mask);
+    }
+    for (int j = full; j < n; j++)
+        if (age[j] == best)
+            return j;
+    return 0;
+}
+#endif
+
+ShiftFn shift_ages = shift_ages_scalar;
+MinAgeFn min_age = min_age_scalar;
+
+// Picks the widest age kernels this CPU supports
+void select_kernels() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        shift_ages = shift_ages_avx2;
+        min_age = min_age_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        shift_ages = shift_ages_sse2;
+        min_age = min_age_sse2;
+    }
+#endif
+}
+
+int simulate_aging_eager(int *references, int num_references, int num_frames) {
+    EagerSim sim;
+    int padded = (num_frames + 31) & ~31;   // kernels shift whole vectors
+    sim.num_frames = num_frames;
+    sim.used = 0;
+    sim.page_number = malloc(num_frames * sizeof(int));
+    sim.age = calloc(padded, 1);
+    sim.referenced = calloc((num_frames + 63) / 64, sizeof(uint64_t));
+    if (!sim.page_number || !sim.age || !sim.referenced) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    page_map_init(&sim.map, num_frames);
+
+    int page_faults = 0;
+    for (int i = 0; i < num_references; i++) {
+        int page = references[i];
+        int frame = sim.map.values[page_map_slot(&sim.map, page)];
+        if (frame < 0) {
+            page_faults++;
+            if (sim.used < num_frames) {
+                frame = sim.used++;
+            } else {
+                frame = min_age(sim.age, num_frames);
+                page_map_remove(&sim.map, page_map_slot(&sim.map, sim.page_number[frame]));
             }
+            sim.page_number[frame] = page;
+            sim.age[frame] = 0;
+            page_map_put(&sim.map, page, frame);
         }
+        sim.referenced[frame / 64] |= 1ULL << (frame % 64);
+        shift_ages(sim.age, sim.referenced, num_frames);
+    }
 
-        // Page fault: page not found in memory
-        if (!found) {
+    free(sim.page_number);
+    free(sim.age);
+    free(sim.referenced);
+    page_map_free(&sim.map);
+    return page_faults;
+}
+
+/*
+ * Lazy engine: ages are only brought up to date when they are needed.
+ * Each frame keeps its age as of the last reference that touched it and
+ * that reference's number; its age at reference now is the stored age
+ * shifted right once per reference since. A hit updates one frame, and
+ * a miss computes ages while it looks for the victim, stopping at the
+ * first age of 0.
+ */
+unsigned char age_at(unsigned char age, long since) {
+    return since >= 8 ? 0 : age >> since;
+}
+
+int simulate_aging_lazy(int *references, int num_references, int num_frames) {
+    int *page_number = malloc(num_frames * sizeof(int));
+    unsigned char *age = malloc(num_frames);
+    long *stamp = malloc(num_frames * sizeof(long));
+    if (!page_number || !age || !stamp) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    PageMap map;
+    page_map_init(&map, num_frames);
+
+    int used = 0;
+    int page_faults = 0;
+    for (long i = 0; i < num_references; i++) {
+        int page = references[i];
+        int frame = map.values[page_map_slot(&map, page)];
+        if (frame < 0) {
             page_faults++;
-            int replace_index = -1;
-            unsigned int min_age = 0xFFFFFFFF;
-
-            // Find the frame with the smallest age (least recently used)
-            for (int j = 0; j < num_frames; j++) {
-                if (frames[j].page_number == -1) {
-                    replace_index = j; // Empty slot
-                    break;
-                }
-                if (frames[j].age < min_age) {
-                    min_age = frames[j].age;
-                    replace_index = j;
+            if (used < num_frames) {
+                frame = used++;
+            } else {
+                // Ages as they stood after the previous reference
+                frame = 0;
+                unsigned char best = 0xFF;
+                for (int j = 0; j < num_frames && best != 0; j++) {
+                    unsigned char a = age_at(age[j], i - 1 - stamp[j]);
+                    if (a < best) {
+                        best = a;
+                        frame = j;
+                    }
                 }
+                page_map_remove(&map, page_map_slot(&map, page_number[frame]));
             }
+            page_number[frame] = page;
+            age[frame] = 0;
+            stamp[frame] = i - 1;
+            page_map_put(&map, page, frame);
+        }
+        age[frame] = age_at(age[frame], i - stamp[frame]) | 0x80;
+        stamp[frame] = i;
+    }
+
+    free(page_number);
+    free(age);
+    free(stamp);
+    page_map_free(&map);
+    return page_faults;
+}
+
+typedef int (*SimulateFn)(int *references, int num_references, int num_frames);
+
+typedef struct {
+    const char *name;
+    SimulateFn simulate;
+} Engine;
+
+Engine engines[] = {
+    {"indexed", simulate_aging},
+    {"eager", simulate_aging_eager},
+    {"lazy", simulate_aging_lazy},
+};
+
+// Renumbers pages 0..num_unique-1 in order of first reference
+int *page_ids(int *references, int num_references, int *num_unique) {
+    int *ids = malloc(num_references * sizeof(int) + 1);
+    if (!ids) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    PageMap map;
+    page_map_init(&map, 0);
+    for (int i = 0; i < num_references; i++) {
+        int slot = page_map_slot(&map, references[i]);
+        if (map.values[slot] < 0) {
+            page_map_put(&map, references[i], map.size);
+            slot = page_map_slot(&map, references[i]);
+        }
+        ids[i] = map.values[slot];
+    }
+    *num_unique = map.size;
+    page_map_free(&map);
+    return ids;
+}
+
+/*
+ * LRU and OPT are stack algorithms: a cache of F frames holds the top F
+ * entries of one stack, so a reference faults exactly when its stack
+ * distance is more than F. One pass that histograms the distances gives
+ * the faults for every frame count (Mattson et al.). faults[F] is filled
+ * for F = 1..num_unique.
+ */
+void faults_from_distances(long *histogram, long cold, int num_unique, double *faults) {
+    long beyond = cold;     // references whose distance exceeds F
+    for (int f = num_unique; f >= 1; f--) {
+        faults[f] = beyond;
+        beyond += histogram[f];
+    }
+}
+
+// Adds delta at time t of a Fenwick tree over reference times
+void fenwick_add(int *tree, int n, int t, int delta) {
+    for (t++; t <= n; t += t & -t)
+        tree[t] += delta;
+}
 
-            // Replace the chosen frame with the new page
-            frames[replace_index].page_number = current_page;
-            frames[replace_index].referenced = 1;
-            frames[replace_index].age = 0;
+// Sum over times before t
+int fenwick_prefix(int *tree, int t) {
+    int sum = 0;
+    for (; t > 0; t -= t & -t)
+        sum += tree[t];
+    return sum;
+}
+
+/*
+ * LRU distance: one more than the number of distinct pages referenced
+ * since the page's previous reference. The tree marks the latest
+ * reference time of every page, so that count is a range sum.
+ */
+void lru_curve(int *references, int num_references, double *faults) {
+    int num_unique;
+    int *ids = page_ids(references, num_references, &num_unique);
+    int *last = malloc(num_unique * sizeof(int));
+    int *tree = calloc(num_references + 1, sizeof(int));
+    long *histogram = calloc(num_unique + 2, sizeof(long));
+    if (!last || !tree || !histogram) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memset(last, -1, num_unique * sizeof(int));
+    long cold = 0;
+    for (int i = 0; i < num_references; i++) {
+        int page = ids[i];
+        if (last[page] >= 0) {
+            histogram[fenwick_prefix(tree, i) - fenwick_prefix(tree, last[page] + 1) + 1]++;
+            fenwick_add(tree, num_references, last[page], -1);
+        } else {
+            cold++;
         }
+        fenwick_add(tree, num_references, i, 1);
+        last[page] = i;
+    }
+    faults_from_distances(histogram, cold, num_unique, faults);
+    free(ids);
+    free(last);
+    free(tree);
+    free(histogram);
+}
+
+/*
+ * OPT distance with the priority stack: the referenced page goes to the
+ * top, and the pages above its old position are pushed down one level at
+ * a time, each level keeping whichever of the two candidates is needed
+ * again sooner.
+ */
+void opt_curve(int *references, int num_references, double *faults) {
+    int num_unique;
+    int *ids = page_ids(references, num_references, &num_unique);
+    int *next = malloc(num_references * sizeof(int) + 1);   // next use of ids[i]
+    int *next_use = malloc(num_unique * sizeof(int));       // of each page, now
+    int *stack = malloc(num_unique * sizeof(int));
+    long *histogram = calloc(num_unique + 2, sizeof(long));
+    if (!next || !next_use || !stack || !histogram) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int p = 0; p < num_unique; p++)
+        next_use[p] = num_references;
+    for (int i = num_references - 1; i >= 0; i--) {
+        next[i] = next_use[ids[i]];
+        next_use[ids[i]] = i;
+    }
 
-        // Age update step for all frames (bit shifting)
-        for (int j = 0; j < num_frames; j++) {
-            if (frames[j].page_number != -1) {
-                // Shift age to the right and set MSB if it was referenced
-                frames[j].age = (frames[j].age >> 1) | (frames[j].referenced << 7);
-                frames[j].referenced = 0; // Reset referenced flag for next cycle
+    int size = 0;
+    long cold = 0;
+    for (int i = 0; i < num_references; i++) {
+        int page = ids[i];
+        int pos = 0;
+        while (pos < size && stack[pos] != page)
+            pos++;
+        if (pos < size)
+            histogram[pos + 1]++;
+        else
+            cold++;
+        next_use[page] = next[i];
+        if (pos == 0 && size > 0)
+            continue;
+        int carry = size > 0 ? stack[0] : page;
+        stack[0] = page;
+        for (int j = 1; j < pos; j++) {
+            if (next_use[carry] < next_use[stack[j]]) {
+                int t = stack[j];
+                stack[j] = carry;
+                carry = t;
             }
         }
+        if (pos == size)
+            size++;
+        stack[pos] = carry;
     }
+    faults_from_distances(histogram, cold, num_unique, faults);
+    free(ids);
+    free(next);
+    free(next_use);
+    free(stack);
+    free(histogram);
+}
 
-    free(frames);
-    return page_faults;
+/*
+ * Exact aging sweep on a pool of threads. Every simulation only reads the
+ * trace, so workers share it and each takes the next frame count under a
+ * lock. Jobs are handed out largest frame count first so the longest ones
+ * do not start last; results land in faults[] by frame count. With a list
+ * of policies, each job runs all of them in one pass and fills one column
+ * of faults per policy; otherwise column 0 comes from simulate.
+ */
+typedef struct {
+    int *references;
+    int num_references;
+    SimulateFn simulate;
+    const Policy **policies;
+    int num_policies;
+    int *frames;            // frame counts to run, largest first
+    int num_jobs;
+    int next_job;
+    pthread_mutex_t lock;
+    double **faults;
+} Sweep;
+
+void *sweep_worker(void *arg) {
+    Sweep *sweep = (Sweep *)arg;
+    while (1) {
+        pthread_mutex_lock(&sweep->lock);
+        int job = sweep->next_job++;
+        pthread_mutex_unlock(&sweep->lock);
+        if (job >= sweep->num_jobs)
+            break;
+        int num_frames = sweep->frames[job];
+        if (sweep->num_policies == 0) {
+            sweep->faults[0][num_frames] =
+                sweep->simulate(sweep->references, sweep->num_references, num_frames);
+            continue;
+        }
+        long page_faults[MAX_POLICIES];
+        simulate_policies(sweep->policies, sweep->num_policies, sweep->references,
+                          sweep->num_references, num_frames, page_faults);
+        for (int k = 0; k < sweep->num_policies; k++)
+            sweep->faults[k][num_frames] = page_faults[k];
+    }
+    return NULL;
+}
+
+void run_sweep(int *references, int num_references, SimulateFn simulate,
+               const Policy **run, int num_run, int min_frames, int max_frames, int step,
+               int num_threads, double **faults) {
+    Sweep sweep;
+    sweep.references = references;
+    sweep.num_references = num_references;
+    sweep.simulate = simulate;
+    sweep.policies = run;
+    sweep.num_policies = num_run;
+    sweep.frames = malloc(((max_frames - min_frames) / step + 1) * sizeof(int));
+    if (!sweep.frames) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    sweep.num_jobs = 0;
+    for (int f = min_frames; f <= max_frames; f += step)
+        sweep.frames[sweep.num_jobs++] = f;
+    for (int i = 0, j = sweep.num_jobs - 1; i < j; i++, j--) {
+        int t = sweep.frames[i];
+        sweep.frames[i] = sweep.frames[j];
+        sweep.frames[j] = t;
+    }
+    sweep.next_job = 0;
+    sweep.faults = faults;
+    pthread_mutex_init(&sweep.lock, NULL);
+
+    if (num_threads > sweep.num_jobs)
+        num_threads = sweep.num_jobs;
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    for (int i = 0; i < num_threads; i++)
+        pthread_create(&threads[i], NULL, sweep_worker, &sweep);
+    for (int i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&sweep.lock);
+    free(threads);
+    free(sweep.frames);
+}
+
+/*
+ * Binary traces: a TraceHeader, then count page numbers in one of two
+ * encodings. RAW32 is native 32-bit ints, mapped and used in place.
+ * VARINT stores each page as the zigzagged difference from the previous
+ * one in LEB128 bytes, which is usually one or two bytes per reference.
+ * Anything without the magic is read as text, one page per line.
+ */
+#define TRACE_MAGIC "PGTRACE1"
+#define ENCODING_RAW32 0
+#define ENCODING_VARINT 1
+
+typedef struct {
+    char magic[8];
+    uint32_t encoding;
+    uint32_t reserved;
+    uint64_t count;
+    uint64_t payload_size;
+} TraceHeader;
+
+typedef struct {
+    int *references;
+    int num_references;
+    char *map;              // the mapped file, if references point into it
+    size_t map_size;
+    int owned;              // references were allocated here
+} Trace;
+
+// What sscanf("%d") accepts: blanks, a sign, then digits. Returns 1 if the line holds a page
+int parse_line(const char *p, const char *eol, int *page) {
+    const char *q = p;
+    while (q < eol && (*q == ' ' || *q == '\t' || *q == '\r' || *q == '\v' || *q == '\f'))
+        q++;
+    int negative = q < eol && *q == '-';
+    if (q < eol && (*q == '-' || *q == '+'))
+        q++;
+    if (q == eol || *q < '0' || *q > '9')
+        return 0;
+    long value = 0;
+    while (q < eol && *q >= '0' && *q <= '9')
+        value = value * 10 + (*q++ - '0');
+    *page = (int)(negative ? -value : value);
+    return 1;
+}
+
+int parse_text(const char *text, size_t size, Trace *trace) {
+    // One allocation sized by the line count, not a doubling realloc
+    size_t lines = 1;
+    for (const char *p = text; (p = memchr(p, '\n', text + size - p)) != NULL; p++)
+        lines++;
+    trace->references = malloc(lines * sizeof(int));
+    if (!trace->references) {
+        perror("malloc");
+        return -1;
+    }
+    trace->owned = 1;
+
+    int n = 0;
+    const char *p = text, *end = text + size;
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol)
+            eol = end;
+        if (parse_line(p, eol, &trace->references[n])) {
+            n++;
+        } else if (eol > p || eol < end) {
+            fprintf(stderr, "Skipping invalid line: %.*s\n", (int)(eol - p), p);
+        }
+        p = eol + 1;
+    }
+    trace->num_references = n;
+    return 0;
+}
+
+int decode_varint(const unsigned char *data, size_t size, uint64_t count, Trace *trace) {
+    trace->references = malloc(count * sizeof(int) + 1);
+    if (!trace->references) {
+        perror("malloc");
+        return -1;
+    }
+    trace->owned = 1;
+    const unsigned char *p = data, *end = data + size;
+    int64_t page = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t zigzag = 0;
+        int shift = 0;
+        do {
+            if (p == end || shift > 63) {
+                fprintf(stderr, "Truncated trace\n");
+                return -1;
+            }
+            zigzag |= (uint64_t)(*p & 0x7F) << shift;
+            shift += 7;
+        } while (*p++ & 0x80);
+        page += (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+        trace->references[i] = (int)page;
+    }
+    trace->num_references = count;
+    return 0;
 }
 
-int main() {
-    const char *filename = "Task3_input.txt";
-    FILE *file = fopen(filename, "r");
-    if (!file) {
+// Maps path and reads it as a binary or text trace
+int load_trace(const char *path, Trace *trace) {
+    memset(trace, 0, sizeof(*trace));
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
         perror("Error opening file");
-        return 1;
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    trace->map_size = st.st_size;
+    trace->map = mmap(NULL, trace->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (trace->map == MAP_FAILED) {
+        perror("mmap");
+        trace->map = NULL;
+        return -1;
     }
+    madvise(trace->map, trace->map_size, MADV_SEQUENTIAL);
 
-    int *references = NULL;
-    int num_references = 0;
-    int max_references = 0;
-    char line[256];
+    TraceHeader *h = (TraceHeader *)trace->map;
+    if (trace->map_size < sizeof(TraceHeader) || memcmp(h->magic, TRACE_MAGIC, 8) != 0)
+        return parse_text(trace->map, trace->map_size, trace);
+    if (h->payload_size > trace->map_size - sizeof(TraceHeader) || h->count > 0x7FFFFFFF) {
+        fprintf(stderr, "Corrupt trace header\n");
+        return -1;
+    }
+    const unsigned char *payload = (const unsigned char *)(h + 1);
+    if (h->encoding == ENCODING_RAW32) {
+        if (h->payload_size < h->count * sizeof(int)) {
+            fprintf(stderr, "Truncated trace\n");
+            return -1;
+        }
+        trace->references = (int *)payload;
+        trace->num_references = h->count;
+        return 0;
+    }
+    if (h->encoding == ENCODING_VARINT)
+        return decode_varint(payload, h->payload_size, h->count, trace);
+    fprintf(stderr, "Unknown trace encoding %u\n", h->encoding);
+    return -1;
+}
+
+void free_trace(Trace *trace) {
+    if (trace->owned)
+        free(trace->references);
+    if (trace->map)
+        munmap(trace->map, trace->map_size);
+}
 
-    // Read all the page numbers from the input file
-    while (fgets(line, sizeof(line), file)) {
+int write_trace(const char *path, int *references, int num_references, int encoding) {
+    FILE *out = fopen(path, "wb");
+    if (!out) {
+        perror(path);
+        return -1;
+    }
+    TraceHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TRACE_MAGIC, 8);
+    h.encoding = encoding;
+    h.count = num_references;
+    fwrite(&h, sizeof(h), 1, out);
+
+    if (encoding == ENCODING_RAW32) {
+        fwrite(references, sizeof(int), num_references, out);
+        h.payload_size = (uint64_t)num_references * sizeof(int);
+    } else {
+        int64_t previous = 0;
+        for (int i = 0; i < num_references; i++) {
+            int64_t delta = references[i] - previous;
+            uint64_t zigzag = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
+            previous = references[i];
+            do {
+                fputc((zigzag & 0x7F) | (zigzag > 0x7F ? 0x80 : 0), out);
+                h.payload_size++;
+                zigzag >>= 7;
+            } while (zigzag);
+        }
+    }
+    // The payload size is only known now
+    rewind(out);
+    fwrite(&h, sizeof(h), 1, out);
+    if (fclose(out) != 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * HyperLogLog estimate of the number of distinct pages in fixed memory:
+ * 2^HLL_BITS one-byte registers, about 1.6% standard error. Each page is
+ * hashed to 64 bits; the top bits pick a register, which keeps the
+ * longest run of leading zeros seen in the rest.
+ */
+#define HLL_BITS 12
+
+typedef struct {
+    unsigned char registers[1 << HLL_BITS];
+} HyperLogLog;
+
+void hll_add(HyperLogLog *hll, int page) {
+    uint64_t h = (uint32_t)page;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL + 0x9E3779B97F4A7C15ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    h ^= h >> 31;
+    int index = (int)(h >> (64 - HLL_BITS));
+    uint64_t rest = (h << HLL_BITS) | (1ULL << (HLL_BITS - 1));    // caps the run
+    unsigned char rank = (unsigned char)(__builtin_clzll(rest) + 1);
+    if (rank > hll->registers[index])
+        hll->registers[index] = rank;
+}
+
+double hll_estimate(const HyperLogLog *hll) {
+    const int m = 1 << HLL_BITS;
+    double sum = 0;
+    int zeros = 0;
+    for (int i = 0; i < m; i++) {
+        sum += 1.0 / (double)(1ULL << hll->registers[i]);
+        zeros += hll->registers[i] == 0;
+    }
+    double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    // Few pages: linear counting on the empty registers is more accurate
+    if (estimate <= 2.5 * m && zeros > 0)
+        estimate = m * log((double)m / zeros);
+    return estimate;
+}
+
+/*
+ * Streaming mode: reads pages one line at a time (stdin for "-") and runs
+ * every chosen policy at every chosen frame count side by side, printing
+ * the fault rate of each over the last window of references as it goes.
+ * Memory is the frames and policy state plus the estimator, whatever the
+ * length of the trace. OPT needs the future, so it is not available here.
+ */
+int stream_trace(const char *path, const Policy **run, int num_run, int *frame_counts,
+                 int num_counts, long window) {
+    FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!in) {
+        perror("Error opening file");
+        return -1;
+    }
+
+    int num_sims = num_run * num_counts;
+    FrameStore *stores = alloc_zeroed(num_sims * sizeof(FrameStore));
+    void **states = alloc_zeroed(num_sims * sizeof(void *));
+    long *window_faults = alloc_zeroed(num_sims * sizeof(long));
+    for (int k = 0; k < num_sims; k++) {
+        frame_store_init(&stores[k], frame_counts[k % num_counts]);
+        states[k] = run[k / num_counts]->create(frame_counts[k % num_counts], NULL, 0);
+    }
+    HyperLogLog unique;
+    memset(&unique, 0, sizeof(unique));
+
+    printf("references unique");
+    for (int k = 0; k < num_sims; k++) {
+        if (num_run > 1)
+            printf(" %s:%d", run[k / num_counts]->name, frame_counts[k % num_counts]);
+        else
+            printf(" %d", frame_counts[k]);
+    }
+    printf("\n");
+
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    long now = 0, window_start = 0;
+    while (1) {
+        length = getline(&line, &capacity, in);
         int page;
-        if (sscanf(line, "%d", &page) != 1) {
-            fprintf(stderr, "Skipping invalid line: %s", line);
-            continue;
+        if (length >= 0 && parse_line(line, line + length, &page)) {
+            for (int k = 0; k < num_sims; k++)
+                window_faults[k] +=
+                    policy_access(run[k / num_counts], states[k], &stores[k], page, now);
+            hll_add(&unique, page);
+            now++;
+        } else if (length > 1 || (length == 1 && line[0] != '\n')) {
+            fprintf(stderr, "Skipping invalid line: %.*s\n", (int)strcspn(line, "\n"), line);
         }
-        // Expand memory if needed
-        if (num_references >= max_references) {
-            max_references = (max_references == 0) ? 1 : max_references * 2;
-            int *temp = realloc(references, max_references * sizeof(int));
-            if (!temp) {
-                perror("realloc");
-                fclose(file);
-                free(references);
+
+        // A full window, or what is left of the last one at the end
+        if (now - window_start == window || (length < 0 && now > window_start)) {
+            printf("%ld %.0f", now, hll_estimate(&unique));
+            for (int k = 0; k < num_sims; k++) {
+                printf(" %.2f", window_faults[k] * 1000.0 / (now - window_start));
+                window_faults[k] = 0;
+            }
+            printf("\n");
+            fflush(stdout);
+            window_start = now;
+        }
+        if (length < 0)
+            break;
+    }
+
+    for (int k = 0; k < num_sims; k++) {
+        run[k / num_counts]->destroy(states[k]);
+        frame_store_free(&stores[k]);
+    }
+    free(stores);
+    free(states);
+    free(window_faults);
+    free(line);
+    if (in != stdin)
+        fclose(in);
+    return 0;
+}
+
+void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-e indexed|eager|lazy] [-p policy[,policy...]] [-j threads]\n"
+                    "          [-r min:max[:step]] [-w tau]\n"
+                    "          [-c out_file [-E raw32|varint]] [trace_file]\n"
+                    "       %s [-p policy[,policy...]] [-w tau] -f frames[,frames...]\n"
+                    "          [-i window] [trace_file | -]\n"
+                    "Policies: aging lru opt clock wsclock 2q arc\n", name, name);
+}
+
+int main(int argc, char *argv[]) {
+    SimulateFn simulate = simulate_aging;
+    const Policy *run[MAX_POLICIES] = {&aging_policy};
+    int num_run = 1;
+    int num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int min_frames = 1, max_frames = 0, step = 1;   // max 0: up to num_unique
+    const char *convert = NULL;
+    int encoding = ENCODING_VARINT;
+    int *frame_counts = NULL;   // streaming mode when set
+    int num_counts = 0;
+    long window = 100000;
+    int opt;
+    while ((opt = getopt(argc, argv, "e:p:j:r:w:c:E:f:i:")) != -1) {
+        int found = 0;
+        if (opt == 'e') {
+            for (size_t k = 0; k < sizeof(engines) / sizeof(engines[0]); k++) {
+                if (strcmp(optarg, engines[k].name) == 0) {
+                    simulate = engines[k].simulate;
+                    found = 1;
+                }
+            }
+        } else if (opt == 'p') {
+            num_run = 0;
+            found = 1;
+            for (char *name = strtok(optarg, ","); name && found; name = strtok(NULL, ",")) {
+                found = 0;
+                for (size_t k = 0; k < sizeof(policies) / sizeof(policies[0]); k++) {
+                    if (strcmp(name, policies[k]->name) == 0 && num_run < MAX_POLICIES) {
+                        run[num_run++] = policies[k];
+                        found = 1;
+                    }
+                }
+            }
+            found = found && num_run > 0;
+        } else if (opt == 'j') {
+            num_threads = atoi(optarg);
+            found = num_threads > 0;
+        } else if (opt == 'r') {
+            int n = sscanf(optarg, "%d:%d:%d", &min_frames, &max_frames, &step);
+            found = n >= 2 && min_frames >= 1 && max_frames >= min_frames && step >= 1;
+        } else if (opt == 'w') {
+            wsclock_tau = atol(optarg);
+            found = wsclock_tau > 0;
+        } else if (opt == 'f') {
+            free(frame_counts);
+            frame_counts = alloc_zeroed((strlen(optarg) / 2 + 1) * sizeof(int));
+            num_counts = 0;
+            found = 1;
+            for (char *count = strtok(optarg, ","); count && found; count = strtok(NULL, ",")) {
+                frame_counts[num_counts] = atoi(count);
+                found = frame_counts[num_counts++] > 0;
+            }
+            found = found && num_counts > 0;
+        } else if (opt == 'i') {
+            window = atol(optarg);
+            found = window > 0;
+        } else if (opt == 'c') {
+            convert = optarg;
+            found = 1;
+        } else if (opt == 'E') {
+            found = 1;
+            if (strcmp(optarg, "raw32") == 0)
+                encoding = ENCODING_RAW32;
+            else if (strcmp(optarg, "varint") == 0)
+                encoding = ENCODING_VARINT;
+            else
+                found = 0;
+        }
+        if (!found) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    select_kernels();
+
+    if (frame_counts) {
+        for (int k = 0; k < num_run; k++) {
+            if (run[k] == &opt_policy) {
+                fprintf(stderr, "opt needs the whole trace and cannot stream\n");
                 return 1;
             }
-            references = temp;
         }
-        references[num_references++] = page;
+        if (convert) {
+            fprintf(stderr, "-c does not apply to streaming mode\n");
+            return 1;
+        }
+        int failed = stream_trace(optind < argc ? argv[optind] : "-", run, num_run,
+                                  frame_counts, num_counts, window);
+        free(frame_counts);
+        return failed ? 1 : 0;
+    }
+
+    const char *filename = optind < argc ? argv[optind] : "Task3_input.txt";
+    Trace trace;
+    if (load_trace(filename, &trace) < 0) {
+        free_trace(&trace);
+        return 1;
+    }
+    int *references = trace.references;
+    int num_references = trace.num_references;
+
+    if (convert) {
+        int failed = write_trace(convert, references, num_references, encoding);
+        free_trace(&trace);
+        return failed ? 1 : 0;
     }
-    fclose(file);
 
     if (num_references == 0) {
         fprintf(stderr, "No references read from file.\n");
-        free(references);
+        free_trace(&trace);
         return 1;
     }
 
     int num_unique = count_unique_pages(references, num_references);
+    double *faults[MAX_POLICIES];
+    for (int k = 0; k < num_run; k++) {
+        faults[k] = malloc((num_unique + 1) * sizeof(double));
+        if (!faults[k]) {
+            perror("malloc");
+            free_trace(&trace);
+            return 1;
+        }
+    }
+
+    // More frames than pages never changes the result
+    if (max_frames == 0 || max_frames > num_unique)
+        max_frames = num_unique;
+    if (min_frames > max_frames) {
+        fprintf(stderr, "-r starts past the %d unique pages in the trace; nothing to print\n",
+                num_unique);
+        for (int k = 0; k < num_run; k++)
+            free(faults[k]);
+        free_trace(&trace);
+        return 0;
+    }
 
-    // Run the algorithm for 1 up to the number of unique frames
-    for (int num_frames = 1; num_frames <= num_unique; num_frames++) {
-        int page_faults = simulate_aging(references, num_references, num_frames);
-        double faults_per_1000 = (double)page_faults * 1000.0 / num_references;
-        printf("%d %.2f\n", num_frames, faults_per_1000);
+    /*
+     * The one-pass curves cover every frame count; the range
+     * picks rows. Aging on its own goes through the chosen engine, and any
+     * other single policy or list of policies shares one pass of the trace
+     * per frame count.
+     */
+    if (num_run > 1) {
+        run_sweep(references, num_references, NULL, run, num_run, min_frames, max_frames,
+                  step, num_threads, faults);
+    } else if (run[0] == &lru_policy) {
+        lru_curve(references, num_references, faults[0]);
+    } else if (run[0] == &opt_policy) {
+        opt_curve(references, num_references, faults[0]);
+    } else if (run[0] == &aging_policy) {
+        run_sweep(references, num_references, simulate, NULL, 0, min_frames, max_frames, step,
+                  num_threads, faults);
+    } else {
+        run_sweep(references, num_references, NULL, run, 1, min_frames, max_frames, step,
+                  num_threads, faults);
+    }
+
+    // Several policies get a header naming the columns
+    if (num_run > 1) {
+        printf("frames");
+        for (int k = 0; k < num_run; k++)
+            printf(" %s", run[k]->name);
+        printf("\n");
+    }
+    for (int num_frames = min_frames; num_frames <= max_frames; num_frames += step) {
+        printf("%d", num_frames);
+        for (int k = 0; k < num_run; k++)
+            printf(" %.2f", faults[k][num_frames] * 1000.0 / num_references);
+        printf("\n");
     }
 
-    free(references);
+    for (int k = 0; k < num_run; k++)
+        free(faults[k]);
+    free_trace(&trace);
     return 0;
 }